@@ -0,0 +1,68 @@
+#!/bin/bash
+# benchmark tsmm2 rendering and encoding on a matrix of configurations.
+#
+# Every run prints one line of JSON: the configuration and the
+# performance counters reported by `tsmm2 --stats`.
+# Output of different builds can be compared with e.g. diff or jq.
+
+#binary to test
+export TSMM2=${TSMM2:-./tsmm2}
+
+#parent of the scratch dir for PNG output, preferably on a tmpfs
+export BENCHDIR=${BENCHDIR:-/dev/shm}
+
+export DURATION=${DURATION:-2}  # in seconds
+export HEIGHTS=${HEIGHTS:-"360 720 1080 2160"}
+export FPSS=${FPSS:-"25/1 30000/1001 60/1"}
+export LEVELS=${LEVELS:-"0 1 6"}
+export JOBS=${JOBS:-"1 $(getconf _NPROCESSORS_ONLN)"}
+export SINKS=${SINKS:-"png y4m"}
+
+################################################################################
+
+function benchrun
+{
+	# $1: sink (png, y4m)
+	# $2: height
+	# $3: fps
+	# $4: compression level
+	# $5: jobs
+	local STATS="${WORKDIR}/stats.json"
+	rm -rf "${WORKDIR}/frames"
+	mkdir -p "${WORKDIR}/frames"
+	if test "$1" = "y4m"; then
+		$TSMM2 -H $2 -f $3 -d ${DURATION} -j $5 --stats "${STATS}" --y4m /dev/null
+	else
+		$TSMM2 -H $2 -f $3 -d ${DURATION} -j $5 -C $4 --stats "${STATS}" "${WORKDIR}/frames"
+	fi
+	printf '{"sink": "%s", "height": %d, "fps": "%s", "compression": %d, "jobs": %d, "stats": %s}\n' \
+		$1 $2 $3 $4 $5 "$(tr -d '\n' < "${STATS}" | tr -s ' ')"
+	rm -rf "${WORKDIR}/frames" "${STATS}"
+}
+
+if test ! -x "${TSMM2}"; then
+	echo "${TSMM2} was not found, run 'make' first." >&2
+	exit 1
+fi
+
+set -e
+mkdir -p "${BENCHDIR}"
+# a private directory, only this is removed at exit
+WORKDIR=$(mktemp -d "${BENCHDIR}/tsmm2-bench.XXXXXX")
+trap 'rm -rf "${WORKDIR}"' exit
+
+for SINK in ${SINKS}; do
+	for HEIGHT in ${HEIGHTS}; do
+		for FPS in ${FPSS}; do
+			for J in ${JOBS}; do
+				if test "${SINK}" = "y4m"; then
+					benchrun ${SINK} ${HEIGHT} ${FPS} -1 ${J}
+					continue
+				fi
+				for C in ${LEVELS}; do
+					benchrun ${SINK} ${HEIGHT} ${FPS} ${C} ${J}
+				done
+			done
+		done
+	done
+done
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2012, 2014 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* compare frames written by the command-line application with
+ * --format raw and --frame-text to the library's, see `make check`.
+ * The settings must match those of the command-line in the Makefile.
+ *
+ * Usage: frame_text <dirname> <text>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "tsmm2.h"
+
+static int check_frame (Tsmm2Context const *c, const char *dir, const int64_t fn) {
+	char filename[1024];
+	int w, h, rv = -1;
+
+	tsmm2_frame_size (c, &w, &h);
+	const size_t size = (size_t)w * h * 4;
+	uint8_t *cli = malloc (size);
+	uint8_t *lib = malloc (size);
+
+	snprintf (filename, sizeof (filename), "%s/t%08"PRId64".raw", dir, fn);
+	FILE *x = fopen (filename, "rb");
+	if (!cli || !lib || !x || fread (cli, 1, size, x) != size) {
+		fprintf (stderr, "Error: Cannot read '%s'.\n", filename);
+	} else if (tsmm2_render_frame (c, fn, lib, w * 4)) {
+		fprintf (stderr, "Error: Cannot render frame %"PRId64".\n", fn);
+	} else if (memcmp (cli, lib, size)) {
+		fprintf (stderr, "FAIL: frame %"PRId64" differs from '%s'.\n", fn, filename);
+	} else {
+		rv = 0;
+	}
+	if (x) {
+		fclose (x);
+	}
+	free (cli);
+	free (lib);
+	return rv;
+}
+
+int main (int argc, char **argv) {
+	Tsmm2Settings s;
+	int rv = 0;
+
+	if (argc != 3) {
+		fprintf (stderr, "Usage: %s <dirname> <text>\n", argv[0]);
+		return 1;
+	}
+
+	/* tsmm2 -H 180 -d 1 -T '' -t <text> --format raw <dirname> */
+	tsmm2_settings_init (&s);
+	s.height = 180;
+	s.frames = 25;
+	s.text = argv[2];
+
+	Tsmm2Context *c = tsmm2_context_create (&s);
+	if (!c) {
+		fprintf (stderr, "Error: Cannot create context.\n");
+		return 1;
+	}
+	/* the first frame has the title and the length of the sequence */
+	rv |= check_frame (c, argv[1], 0);
+	rv |= check_frame (c, argv[1], 7);
+	tsmm2_context_free (c);
+
+	if (!rv) {
+		printf ("PASS: frames match the library's\n");
+	}
+	return rv ? 1 : 0;
+}
@@ -15,6 +15,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fallocate
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,11 +27,26 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <math.h>
+#include <time.h>
 #include <getopt.h>
 #include <cairo/cairo.h>
 #include <pango/pango.h>
 #include <pango/pangocairo.h>
 #include <pthread.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "tsmm2.h"
 
 #ifndef MAX
 #define MAX(A,B) ( (A) < (B) ? (B) : (A) )
@@ -36,11 +55,20 @@
 #define MIN(A,B) ( (A) < (B) ? (A) : (B) )
 #endif
 
+/* color channels of a cairo ARGB32 pixel */
+#define CH_R(p) (((p) >> 16) & 0xff)
+#define CH_G(p) (((p) >>  8) & 0xff)
+#define CH_B(p) (((p) >>  0) & 0xff)
+
 #ifdef CUSTOM_PNG_WRITER
 #include <zlib.h>
 #include <png.h>
 #endif
 
+#if defined CUSTOM_PNG_WRITER && defined HAVE_IO_URING
+#include <liburing.h>
+#endif
+
 #ifndef FONTFILE
 #define FONTFILE "DroidSansMono"
 #endif
@@ -51,8 +79,6 @@
 
 #define DIRSEP '/'
 
-static PangoFontDescription *font_desc;
-
 /*** part one: timecode functions */
 
 typedef struct Rational {
@@ -72,7 +98,7 @@ typedef struct TimecodeTime {
 	int32_t frame; ///< timecode frames 0..fps
 } TimecodeTime;
 
-static int format_tc (char *p, TimecodeRate *tr, TimecodeTime *tc) {
+static int format_tc (char *p, TimecodeRate const *tr, TimecodeTime *tc) {
 	return sprintf (p, "%02d:%02d:%02d%c%02d",
 			tc->hour,
 			tc->minute,
@@ -390,8 +416,137 @@ static void smpte02 (cairo_t* cr, const float w, const float h) {
 	cairo_fill (cr);
 }
 
+/*** pixel patterns
+ * The pixel-aligned parts of the test-screen (background, frames, gratings
+ * and hash) are written directly into the image, in bands of rows by several
+ * threads. Only fractional line-ends are left to cairo.
+ */
+
+typedef struct TestPattern {
+	uint32_t *d;
+	int stride;               ///< in pixels
+	int w, h;
+	uint32_t bg, frame, white, black;
+	int i_x0, i_x1, i_y0, i_y1; ///< inner main bounds
+	int vl_y1;                ///< vertical lines cover all pixels of rows [i_y0, vl_y1)
+	int hs_x1;                ///< horizontal stripes cover all pixels of columns [i_x0, hs_x1)
+	int hash_w, hash_h;
+	uint32_t *vrow;           ///< a row of the vertical lines
+	uint8_t *hrow;            ///< rows covered by horizontal stripes
+} TestPattern;
+
+typedef struct PatternBand {
+	TestPattern const *tp;
+	int y0, y1;
+	pthread_t thread;
+	int running;
+} PatternBand;
+
+/* opaque color, as cairo fills it */
+static uint32_t pattern_color (const double r, const double g, const double b) {
+	cairo_surface_t *cs = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 1, 1);
+	cairo_t *cr = cairo_create (cs);
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba (cr, r, g, b, 1.0);
+	cairo_paint (cr);
+	cairo_destroy (cr);
+	cairo_surface_flush (cs);
+	const uint32_t c = *(uint32_t*) cairo_image_surface_get_data (cs);
+	cairo_surface_destroy (cs);
+	return c;
+}
+
+/* p[0] = a, p[1] = b, p[2] = a, ... */
+static void pattern_span (uint32_t *p, const int n, const uint32_t a, const uint32_t b) {
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i v = _mm_set_epi32 (b, a, b, a);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128 ((__m128i*) (p + i), v);
+	}
+#endif
+	for (; i + 1 < n; i += 2) {
+		p[i] = a;
+		p[i + 1] = b;
+	}
+	if (i < n) {
+		p[i] = a;
+	}
+}
+
+static void pattern_row (TestPattern const *tp, const int y) {
+	uint32_t *p = tp->d + (size_t)y * tp->stride;
+	const int w = tp->w;
+	const int h = tp->h;
+	int i;
+
+	pattern_span (p, w, tp->bg, tp->bg);
+
+	/* concentric 1px frames, 8px apart */
+	for (i = 0; 16 * i < h; ++i) {
+		const int xa = MAX(0, MIN(8 * i, w - 8 * i));
+		const int xb = MIN(w - 1, MAX(8 * i, w - 8 * i));
+		const int ya = MIN(8 * i, h - 8 * i);
+		const int yb = MAX(8 * i, h - 8 * i);
+		if (y == ya || y == yb) {
+			if (xa <= xb) {
+				pattern_span (p + xa, xb - xa + 1, tp->frame, tp->frame);
+			}
+		} else if (y > ya && y < yb) {
+			if (8 * i < w) p[8 * i] = tp->frame;
+			if (w - 8 * i >= 0 && w - 8 * i < w) p[w - 8 * i] = tp->frame;
+		}
+	}
+
+	if (y < tp->i_y0 || y >= tp->i_y1) {
+		return;
+	}
+
+	if (y < tp->vl_y1) {
+		memcpy (p + tp->i_x0, tp->vrow + tp->i_x0, (tp->i_x1 - tp->i_x0) * sizeof (uint32_t));
+	} else {
+		pattern_span (p + tp->i_x0, tp->i_x1 - tp->i_x0, tp->white, tp->white);
+	}
+
+	if (tp->hrow[y] && tp->hs_x1 > tp->i_x0) {
+		pattern_span (p + tp->i_x0, tp->hs_x1 - tp->i_x0, tp->black, tp->black);
+	}
+
+	/* top-left hash: checkerboard, starting with black */
+	const int j = y - tp->i_y0;
+	if (j < tp->hash_h) {
+		if (j & 1) {
+			pattern_span (p + tp->i_x0, tp->hash_w, tp->white, tp->black);
+		} else {
+			pattern_span (p + tp->i_x0, tp->hash_w, tp->black, tp->white);
+		}
+	}
+}
+
+static void *pattern_band (void *arg) {
+	PatternBand *pb = (PatternBand*) arg;
+	int y;
+	for (y = pb->y0; y < pb->y1; ++y) {
+		pattern_row (pb->tp, y);
+	}
+	return NULL;
+}
+
+/* add the part of a rectangle that is inside the given bounds to the path */
+static void clipped_rectangle (cairo_t* cr, float x0, float y0, float x1, float y1,
+		const float bx0, const float by0, const float bx1, const float by1)
+{
+	x0 = MAX(x0, bx0);
+	y0 = MAX(y0, by0);
+	x1 = MIN(x1, bx1);
+	y1 = MIN(y1, by1);
+	if (x0 < x1 && y0 < y1) {
+		cairo_rectangle (cr, x0, y0, x1 - x0, y1 - y0);
+	}
+}
+
 static void testscreen (cairo_t* cr, const float w, const float h, uint8_t mode) {
-	int i,j;
+	int i;
 	float x0, y0;
 	float x1, y1;
 
@@ -400,18 +555,6 @@ static void testscreen (cairo_t* cr, const float w, const float h, uint8_t mode)
 	const float cxp = cx + .5;
 	const float cyp = cy + .5;
 
-	cairo_set_source_rgba (cr, .45, .45, .45, 1.0);
-	cairo_rectangle (cr, 0, 0, w, h);
-	cairo_fill (cr);
-
-	cairo_set_source_rgba (cr, .38, .38, .38, 1.0);
-	cairo_set_line_width (cr, 1.0);
-	cairo_set_line_cap (cr, CAIRO_LINE_CAP_BUTT);
-	for (i = 0; i < h/16 ; ++i) {
-		cairo_rectangle (cr, .5 + i * 8, .5 + i * 8, (w - 16 * i), (h - 16 * i));
-		cairo_stroke (cr);
-	}
-
 	// inner main bounds
 	const float i_x0 = rint(w / 8.);
 	const float i_x1 = rint(w * 7. / 8.);
@@ -422,98 +565,94 @@ static void testscreen (cairo_t* cr, const float w, const float h, uint8_t mode)
 	const float sx1  = (i_x1 - i_x0) / 6.;
 	const float sy1  = (i_y1 - i_y0) / 5.;
 
+	// gratings: lines of 1..5 px width, starting at an integer offset
+	const float lx0 = rint (i_x0 + sx1);
+	const float ly0 = rint (i_y0 + sy1);
+	const float vl_end = i_y0 + sy1;
+	const float hs_end = i_x0 + sx1;
 
-	cairo_save(cr);
+	cairo_surface_t *cs = cairo_get_target (cr);
+	cairo_surface_flush (cs);
 
-	cairo_set_source_rgba (cr, 1.0, 1.0, 1.0, 1.0);
-	cairo_rectangle (cr, i_x0, i_y0, i_x1 - i_x0, i_y1 - i_y0);
-	cairo_clip_preserve (cr);
-	cairo_fill (cr);
+	TestPattern tp;
+	tp.d      = (uint32_t*) cairo_image_surface_get_data (cs);
+	tp.stride = cairo_image_surface_get_stride (cs) / 4;
+	tp.w      = w;
+	tp.h      = h;
+	tp.bg     = pattern_color (.45, .45, .45);
+	tp.frame  = pattern_color (.38, .38, .38);
+	tp.white  = pattern_color (1.0, 1.0, 1.0);
+	tp.black  = pattern_color (0.0, 0.0, 0.0);
+	tp.i_x0   = i_x0;
+	tp.i_x1   = i_x1;
+	tp.i_y0   = i_y0;
+	tp.i_y1   = i_y1;
+	tp.vl_y1  = MIN(floorf (vl_end), i_y1);
+	tp.hs_x1  = MIN(floorf (hs_end), i_x1);
+	tp.hash_w = MIN(ceilf (sx1), i_x1 - i_x0);
+	tp.hash_h = MIN(ceilf (sy1), i_y1 - i_y0);
+	tp.vrow   = malloc (w * sizeof (uint32_t));
+	tp.hrow   = calloc (h, sizeof (uint8_t));
+
+	if (!tp.vrow || !tp.hrow) {
+		free (tp.vrow);
+		free (tp.hrow);
+		return;
+	}
 
+	/* fractional line-ends are collected in the path */
+	cairo_new_path (cr);
 
 	// top-row vertical lines
-	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 1.0);
-
-	cairo_set_line_width (cr, 1.0);
-	x0 = rint (i_x0 + sx1) + .5;
-	for (i = 1; i < sx1; i += 2) {
-		cairo_move_to (cr, x0 + i, i_y0);
-		cairo_line_to (cr, x0 + i, i_y0 + sy1);
-		cairo_stroke (cr);
-	}
-	cairo_set_line_width (cr, 2.0);
-	x0 += .5;
-	for (; i < 2 * sx1; i += 4) {
-		cairo_move_to (cr, x0 + i, i_y0);
-		cairo_line_to (cr, x0 + i, i_y0 + sy1);
-		cairo_stroke (cr);
-	}
-	cairo_set_line_width (cr, 3.0);
-	x0 += .5;
-	for (; i < 3 * sx1; i += 6) {
-		cairo_move_to (cr, x0 + i, i_y0);
-		cairo_line_to (cr, x0 + i, i_y0 + sy1);
-		cairo_stroke (cr);
-	}
-	cairo_set_line_width (cr, 4.0);
-	x0 += .5;
-	for (; i < 4 * sx1; i += 8) {
-		cairo_move_to (cr, x0 + i, i_y0);
-		cairo_line_to (cr, x0 + i, i_y0 + sy1);
-		cairo_stroke (cr);
-	}
-	cairo_set_line_width (cr, 5.0);
-	x0 += .5;
-	for (; i < 5 * sx1 + 8; i += 8) {
-		cairo_move_to (cr, x0 + i, i_y0);
-		cairo_line_to (cr, x0 + i, i_y0 + sy1);
-		cairo_stroke (cr);
+	pattern_span (tp.vrow, w, tp.white, tp.white);
+	for (i = 1; i < 5 * sx1 + 8; ) {
+		const int lw = i < sx1 ? 1 : i < 2 * sx1 ? 2 : i < 3 * sx1 ? 3 : i < 4 * sx1 ? 4 : 5;
+		const int xa = MAX(lx0 + i, i_x0);
+		const int xb = MIN(lx0 + i + lw, i_x1);
+		if (xa < xb) {
+			pattern_span (tp.vrow + xa, xb - xa, tp.black, tp.black);
+		}
+		clipped_rectangle (cr, lx0 + i, tp.vl_y1, lx0 + i + lw, vl_end, i_x0, i_y0, i_x1, i_y1);
+		i += MIN(2 * lw, 8);
 	}
 
 	// left-column horizontal stripes
-	cairo_set_line_width (cr, 1.0);
-	y0 = rint (i_y0 + sy1) + .5;
-	for (i = 1; i < sy1; i += 2) {
-		cairo_move_to (cr, i_x0      , y0 + i);
-		cairo_line_to (cr, i_x0 + sx1, y0 + i);
-		cairo_stroke (cr);
-	}
-	cairo_set_line_width (cr, 2.0);
-	y0 += .5;
-	for (; i < 2 * sy1; i += 4) {
-		cairo_move_to (cr, i_x0      , y0 + i);
-		cairo_line_to (cr, i_x0 + sx1, y0 + i);
-		cairo_stroke (cr);
-	}
-	cairo_set_line_width (cr, 3.0);
-	y0 += .5;
-	for (; i < 3 * sy1; i += 6) {
-		cairo_move_to (cr, i_x0      , y0 + i);
-		cairo_line_to (cr, i_x0 + sx1, y0 + i);
-		cairo_stroke (cr);
-	}
-	cairo_set_line_width (cr, 4.0);
-	y0 += .5;
-	for (; i < i_y1 + 8; i += 8) {
-		cairo_move_to (cr, i_x0      , y0 + i);
-		cairo_line_to (cr, i_x0 + sx1, y0 + i);
-		cairo_stroke (cr);
-	}
-
-	// top-left hash
-	cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
-	cairo_set_line_width (cr, 1.1);
-	x0 = rint (i_x0) + .5;
-	y0 = rint (i_y0) + .5;
-	for (i = 0; i < sx1; ++i) {
-		for (j = 0; j < sy1; ++j) {
-			if ((i + j) % 2 == 1) continue;
-			cairo_move_to (cr, x0 + i, y0 + j);
-			cairo_close_path (cr);
-			cairo_stroke (cr);
+	for (i = 1; i < i_y1 + 8; ) {
+		const int lw = i < sy1 ? 1 : i < 2 * sy1 ? 2 : i < 3 * sy1 ? 3 : 4;
+		int y;
+		for (y = MAX(ly0 + i, i_y0); y < MIN(ly0 + i + lw, i_y1); ++y) {
+			tp.hrow[y] = 1;
 		}
+		clipped_rectangle (cr, tp.hs_x1, ly0 + i, hs_end, ly0 + i + lw, i_x0, i_y0, i_x1, i_y1);
+		i += 2 * lw;
 	}
 
+	PatternBand pb[32];
+	const int n_bands = MAX(1, MIN(MIN(32, sysconf (_SC_NPROCESSORS_ONLN)), h / 64));
+	for (i = 0; i < n_bands; ++i) {
+		pb[i].tp = &tp;
+		pb[i].y0 = h * i / n_bands;
+		pb[i].y1 = h * (i + 1) / n_bands;
+		pb[i].running = i > 0 && 0 == pthread_create (&pb[i].thread, NULL, pattern_band, &pb[i]);
+	}
+	for (i = 0; i < n_bands; ++i) {
+		if (pb[i].running) {
+			pthread_join (pb[i].thread, NULL);
+		} else {
+			pattern_band (&pb[i]);
+		}
+	}
+	free (tp.vrow);
+	free (tp.hrow);
+	cairo_surface_mark_dirty (cs);
+
+	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 1.0);
+	cairo_fill (cr);
+
+	cairo_save(cr);
+	cairo_rectangle (cr, i_x0, i_y0, i_x1 - i_x0, i_y1 - i_y0);
+	cairo_clip (cr);
+
 	if (mode & 1) {
 		// top-row whites
 		x0 = i_x0 + sx1;
@@ -578,17 +717,254 @@ static void testscreen (cairo_t* cr, const float w, const float h, uint8_t mode)
 	triangle (cr, w - 96 * arrowscale, cy, M_PI * 3 / 2, arrowscale);
 }
 
+/* test-screen or color bars, without annotations */
+static cairo_surface_t *test_pattern (const float w, const float h, const uint8_t mode) {
+	cairo_surface_t *cs = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, w, h);
+	cairo_t* cr = cairo_create (cs);
+	if (mode & 4) {
+		if (mode & 2)
+			smpte02 (cr, w, h);
+		else
+			smpte78 (cr, w, h);
+	} else {
+		testscreen (cr, w, h, mode);
+	}
+	cairo_destroy (cr);
+	cairo_surface_flush (cs);
+	return cs;
+}
+
+/*** timing and trace events
+ * Pipeline threads record spans into their own buffer, referenced by a
+ * thread-local pointer. When tracing is disabled the pointer is NULL and
+ * trace_begin() / trace_end() return right away. Buffers are limited to
+ * TRACE_MAX_EVENTS per thread (24 bytes each), later events are dropped.
+ */
+
+#define TRACE_MAX_EVENTS (1 << 18)
+
+static uint64_t perf_now (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct TraceEvent {
+	const char *name;
+	uint64_t ts;  ///< [ns]
+	uint64_t dur; ///< [ns]
+} TraceEvent;
+
+typedef struct TraceBuf {
+	TraceEvent *ev;
+	size_t n;
+	size_t size;
+	size_t dropped; ///< events that did not fit
+} TraceBuf;
+
+static __thread TraceBuf *trace_buf = NULL;
+
+static void trace_span (const char *name, const uint64_t t0, const uint64_t t1) {
+	TraceBuf *tb = trace_buf;
+	if (!tb) {
+		return;
+	}
+	if (tb->n == tb->size) {
+		const size_t size = MIN(TRACE_MAX_EVENTS, MAX(4096, tb->size * 2));
+		TraceEvent *ev = size > tb->size ? realloc (tb->ev, size * sizeof (TraceEvent)) : NULL;
+		if (!ev) {
+			++tb->dropped;
+			return;
+		}
+		tb->ev = ev;
+		tb->size = size;
+	}
+	TraceEvent *e = &tb->ev[tb->n++];
+	e->name = name;
+	e->ts   = t0;
+	e->dur  = t1 - t0;
+}
+
+static inline uint64_t trace_begin (void) {
+	return trace_buf ? perf_now () : 0;
+}
+
+static inline void trace_end (const char *name, const uint64_t t0) {
+	if (trace_buf) {
+		trace_span (name, t0, perf_now ());
+	}
+}
+
+/*** performance counters
+ * Every pipeline thread collects its own statistics, they are only
+ * merged after all threads have finished, so no locks are needed.
+ */
+
+enum {
+	PERF_RESTORE = 0,
+	PERF_MOTION,
+	PERF_OVERLAY,
+	PERF_TEXT,
+	PERF_ENCODE,
+	PERF_WRITE,
+	PERF_LAST
+};
+
+static const char *perf_name[PERF_LAST] = { "restore", "motion", "overlay", "text", "encode", "write" };
+
+/* log-linear histogram of nanoseconds, 16 bins per octave (< 6.25% error) */
+#define PERF_SUB  16
+#define PERF_BINS (61 * PERF_SUB)
+
+typedef struct PerfCounter {
+	uint64_t n;
+	uint64_t total; ///< [ns]
+	uint64_t max;   ///< [ns]
+	uint32_t hist[PERF_BINS];
+} PerfCounter;
+
+typedef struct PerfStats {
+	PerfCounter c[PERF_LAST];
+	uint64_t busy;   ///< [ns] time spent processing frames
+	uint64_t frames; ///< frames processed by this thread
+	uint64_t bytes;  ///< bytes written
+} PerfStats;
+
+static int perf_bin (const uint64_t ns) {
+	if (ns < PERF_SUB) {
+		return ns;
+	}
+	const int msb = 63 - __builtin_clzll (ns);
+	return (msb - 3) * PERF_SUB + ((ns >> (msb - 4)) & (PERF_SUB - 1));
+}
+
+static void perf_count (PerfStats *ps, const int what, const uint64_t dt) {
+	PerfCounter *pc = &ps->c[what];
+	++pc->n;
+	pc->total += dt;
+	pc->max = MAX(pc->max, dt);
+	++pc->hist[perf_bin (dt)];
+}
+
+/* add the time since `t0` (unless `ps` is NULL), return the current time */
+static uint64_t perf_add (PerfStats *ps, const int what, const uint64_t t0) {
+	const uint64_t t1 = perf_now ();
+	if (ps) {
+		perf_count (ps, what, t1 - t0);
+	}
+	trace_span (perf_name[what], t0, t1);
+	return t1;
+}
+
 /*** part three: render Timecode on test-screen */
 
+/* areas of the frame that differ from the static background */
+typedef struct Rect {
+	int x, y, w, h;
+} Rect;
+
+#define DIRTY_MAX 16
+
+typedef struct DirtyRegion {
+	int n;
+	Rect r[DIRTY_MAX];
+} DirtyRegion;
+
+static void dirty_add (DirtyRegion *d, const float x0, const float y0, const float x1, const float y1, const float pad) {
+	if (!d) {
+		return;
+	}
+	Rect r;
+	r.x = floor (x0 - pad);
+	r.y = floor (y0 - pad);
+	r.w = ceil (x1 + pad) - r.x;
+	r.h = ceil (y1 + pad) - r.y;
+
+	if (d->n < DIRTY_MAX) {
+		d->r[d->n++] = r;
+		return;
+	}
+	// out of slots, grow the last one
+	Rect *l = &d->r[d->n - 1];
+	const int rx = MAX(l->x + l->w, r.x + r.w);
+	const int ry = MAX(l->y + l->h, r.y + r.h);
+	l->x = MIN(l->x, r.x);
+	l->y = MIN(l->y, r.y);
+	l->w = rx - l->x;
+	l->h = ry - l->y;
+}
+
+/* outlined text, used for both layouts and cached glyphs */
+static void text_style (cairo_t* cr, PangoLayout *pl) {
+	pango_cairo_layout_path (cr, pl);
+	cairo_set_line_width (cr, 2.5);
+	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.8);
+	cairo_stroke_preserve (cr);
+	cairo_set_line_width (cr, 0.5);
+	cairo_set_source_rgba (cr, 1.0, 1.0, 1.0, 0.8);
+	cairo_stroke_preserve (cr);
+	cairo_set_source_rgba (cr, 1.0, 1.0, 1.0, 1.0);
+	cairo_fill (cr);
+}
+
+/*** text contexts
+ * pango_cairo_create_layout() uses the process-wide default font map, its
+ * caches are shared by all threads and protected by locks. Pipeline threads
+ * own a font map and context instead, referenced by a thread-local pointer.
+ * Threads of library users render with the default font map.
+ */
+static __thread PangoContext *text_ctx = NULL;
+
+#ifndef TSMM2_LIBRARY
+static PangoContext *text_context_new (void) {
+	PangoFontMap *fm = pango_cairo_font_map_new ();
+	PangoContext *ctx = pango_font_map_create_context (fm);
+	g_object_unref (fm); // referenced by the context
+	return ctx;
+}
+#endif
+
+static PangoLayout *text_layout (cairo_t* cr) {
+	if (!text_ctx) {
+		return pango_cairo_create_layout (cr);
+	}
+	pango_cairo_update_context (cr, text_ctx);
+	return pango_layout_new (text_ctx);
+}
+
+/* resolve the font family once, so that every font map finds
+ * the same font with an exact match
+ */
+static void text_resolve_font (PangoFontDescription *desc) {
+	PangoFontMap *fm = pango_cairo_font_map_new ();
+	PangoContext *ctx = pango_font_map_create_context (fm);
+	PangoFont *pf = pango_font_map_load_font (fm, ctx, desc);
+	if (pf) {
+		PangoFontDescription *d = pango_font_describe (pf);
+		const char *family = pango_font_description_get_family (d);
+		if (family) {
+			pango_font_description_set_family (desc, family);
+		}
+		pango_font_description_free (d);
+		g_object_unref (pf);
+	}
+	g_object_unref (ctx);
+	g_object_unref (fm);
+}
+
 static void write_text (cairo_t* cr,
+		PangoFontDescription const *font,
 		const char *txt,
-		const float x, const float y, const int align)
+		const float x, const float y, const int align,
+		DirtyRegion *dirty)
 {
 	int tw, th;
+	float tx = 0, ty = 0;
+	const uint64_t t0 = trace_begin ();
 	cairo_save (cr);
-	PangoLayout * pl = pango_cairo_create_layout (cr);
+	PangoLayout * pl = text_layout (cr);
 
-	pango_layout_set_font_description (pl, font_desc);
+	pango_layout_set_font_description (pl, font);
 
 	pango_layout_set_text (pl, txt, -1);
 	pango_layout_get_pixel_size (pl, &tw, &th);
@@ -596,33 +972,236 @@ static void write_text (cairo_t* cr,
 
 	switch (align) {
 		case 1: // right + middle
-			cairo_translate (cr, -tw, -th / 2.0);
+			tx = -tw; ty = -th / 2.0;
 			break;
 		case 0: // left + middle
-			cairo_translate (cr, 0, -th / 2.0);
+			ty = -th / 2.0;
 			break;
 		case -1: // center + middle
-			cairo_translate (cr, -tw / 2.0, -th / 2.0);
+			tx = -tw / 2.0; ty = -th / 2.0;
 			break;
 	}
+	cairo_translate (cr, tx, ty);
+
+	if (dirty) {
+		/* ink extents + outline stroke width + antialiasing */
+		PangoRectangle ink;
+		pango_layout_get_pixel_extents (pl, &ink, NULL);
+		dirty_add (dirty,
+				x + tx + ink.x, y + ty + ink.y,
+				x + tx + ink.x + ink.width, y + ty + ink.y + ink.height,
+				3);
+	}
 
-	pango_cairo_layout_path (cr, pl);
-	cairo_set_line_width (cr, 2.5);
-	cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.8);
-	cairo_stroke_preserve (cr);
-	cairo_set_line_width (cr, 0.5);
-	cairo_set_source_rgba (cr, 1.0, 1.0, 1.0, 0.8);
-	cairo_stroke_preserve (cr);
-	cairo_set_source_rgba (cr, 1.0, 1.0, 1.0, 1.0);
-	cairo_fill (cr);
+	text_style (cr, pl);
 	g_object_unref (pl);
 	cairo_restore (cr);
 	cairo_new_path (cr);
+	trace_end ("write_text", t0);
+}
+
+/*** glyph cache
+ * frame-number and timecode only use a few glyphs. Those are rendered once
+ * (outline + fill) and per-frame text is composed from the cached cells.
+ */
+#define GLYPH_CHARS "0123456789:;"
+
+typedef struct GlyphAtlas {
+	cairo_surface_t *sf; ///< one cell per glyph, in a row
+	int cw, ch;          ///< cell size
+	int ox, oy;          ///< layout origin inside a cell
+	int th;              ///< logical text height
+	int adv[sizeof(GLYPH_CHARS) - 1]; ///< advance in pango units
+} GlyphAtlas;
+
+static void glyph_atlas_init (GlyphAtlas *ga, PangoFontDescription const *font) {
+	const int n = strlen (GLYPH_CHARS);
+	const int pad = 3; // outline stroke width + antialiasing
+	int i;
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+	cairo_surface_t *cs = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 1, 1);
+	cairo_t *cr = cairo_create (cs);
+	PangoLayout *pl = text_layout (cr);
+	pango_layout_set_font_description (pl, font);
+
+	pango_layout_set_text (pl, GLYPH_CHARS, -1);
+	pango_layout_get_pixel_size (pl, NULL, &ga->th);
+
+	for (i = 0; i < n; ++i) {
+		PangoRectangle ink, logical;
+		pango_layout_set_text (pl, &GLYPH_CHARS[i], 1);
+		pango_layout_get_size (pl, &ga->adv[i], NULL);
+		pango_layout_get_pixel_extents (pl, &ink, &logical);
+		x0 = MIN(x0, MIN(ink.x, logical.x));
+		y0 = MIN(y0, MIN(ink.y, logical.y));
+		x1 = MAX(x1, MAX(ink.x + ink.width, logical.x + logical.width));
+		y1 = MAX(y1, MAX(ink.y + ink.height, logical.y + logical.height));
+	}
+	g_object_unref (pl);
+	cairo_destroy (cr);
+	cairo_surface_destroy (cs);
+
+	ga->ox = pad - x0;
+	ga->oy = pad - y0;
+	ga->cw = x1 - x0 + 2 * pad;
+	ga->ch = y1 - y0 + 2 * pad;
+	ga->sf = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, n * ga->cw, ga->ch);
+
+	cr = cairo_create (ga->sf);
+	pl = text_layout (cr);
+	pango_layout_set_font_description (pl, font);
+	for (i = 0; i < n; ++i) {
+		cairo_save (cr);
+		cairo_translate (cr, i * ga->cw + ga->ox, ga->oy);
+		pango_layout_set_text (pl, &GLYPH_CHARS[i], 1);
+		text_style (cr, pl);
+		cairo_restore (cr);
+		cairo_new_path (cr);
+	}
+	g_object_unref (pl);
+	cairo_destroy (cr);
+	cairo_surface_flush (ga->sf);
+}
+
+static void glyph_atlas_free (GlyphAtlas *ga) {
+	cairo_surface_destroy (ga->sf);
+}
+
+/* same as write_text(), returns -1 if the text is not covered by the cache */
+static int write_text_cached (cairo_t* cr,
+		GlyphAtlas const *ga,
+		const char *txt,
+		const float x, const float y, const int align,
+		DirtyRegion *dirty)
+{
+	int i;
+	int idx[64];
+	int64_t tw = 0;
+	float tx = 0, ty = 0;
+	const int n = strlen (txt);
+
+	if (!ga || n < 1 || n > 64) {
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		const char *p = strchr (GLYPH_CHARS, txt[i]);
+		if (!p) return -1;
+		idx[i] = p - GLYPH_CHARS;
+		tw += ga->adv[idx[i]];
+	}
+
+	switch (align) {
+		case 1: // right + middle
+			tx = -ceil (tw / (float)PANGO_SCALE); ty = -ga->th / 2.0;
+			break;
+		case 0: // left + middle
+			ty = -ga->th / 2.0;
+			break;
+		case -1: // center + middle
+			tx = -ceil (tw / (float)PANGO_SCALE) / 2.0; ty = -ga->th / 2.0;
+			break;
+	}
+
+	const int by = rint (y + ty) - ga->oy;
+	int bx = 0, bx0 = 0;
+	int64_t adv = 0;
+	const uint64_t t0 = trace_begin ();
+
+	cairo_save (cr);
+	for (i = 0; i < n; ++i) {
+		bx = rint (x + tx + adv / (float)PANGO_SCALE) - ga->ox;
+		if (i == 0) bx0 = bx;
+		cairo_set_source_surface (cr, ga->sf, bx - idx[i] * ga->cw, by);
+		cairo_rectangle (cr, bx, by, ga->cw, ga->ch);
+		cairo_fill (cr);
+		adv += ga->adv[idx[i]];
+	}
+	cairo_restore (cr);
+
+	dirty_add (dirty, bx0, by, bx + ga->cw, by + ga->ch, 0);
+	trace_end ("write_text_cached", t0);
+	return 0;
+}
+
+/*** time circle sprites
+ * the circle has only `tcn` dot positions. Each position's antialiased
+ * coverage is rendered once into a small A8 mask, per frame the dots are
+ * composited with their current color.
+ */
+
+typedef struct TimeCircle {
+	int tcn, tcm;
+	float c_rad, rad;
+	cairo_surface_t **dot; ///< coverage mask per position
+	int *dx, *dy;          ///< mask offset per position
+} TimeCircle;
+
+static void time_circle_geometry (TimecodeRate const *r, const float h, int *tcn, int *tcm, float *c_rad, float *rad) {
+	*tcn = ceil (r->fps.num / (double)r->fps.den);
+	*tcm = 1;
+	if (*tcn < 40) {
+		*tcn *= 2;
+		*tcm = 2;
+	}
+	*c_rad = h / 2.9;
+	*rad = M_PI * *c_rad / (*tcn * 6. / 5.);
+}
+
+static int time_circle_init (TimeCircle *tc, const float w, const float h, TimecodeRate const *r) {
+	int i;
+	const float cx = w * .5;
+	const float cy = h * .5;
+
+	time_circle_geometry (r, h, &tc->tcn, &tc->tcm, &tc->c_rad, &tc->rad);
+
+	const int sz = 2 * ceil (tc->rad + 2);
+	tc->dot = calloc (tc->tcn, sizeof (cairo_surface_t*));
+	tc->dx = malloc (tc->tcn * sizeof (int));
+	tc->dy = malloc (tc->tcn * sizeof (int));
+	if (!tc->dot || !tc->dx || !tc->dy) {
+		return -1;
+	}
+
+	for (i = 0; i < tc->tcn; ++i) {
+		const float a = 2 * M_PI * i / (float)tc->tcn;
+		tc->dx[i] = floor (cx + tc->c_rad * sin (a)) - sz / 2;
+		tc->dy[i] = floor (cy - tc->c_rad * cos (a)) - sz / 2;
+		tc->dot[i] = cairo_image_surface_create (CAIRO_FORMAT_A8, sz, sz);
+
+		cairo_t *cr = cairo_create (tc->dot[i]);
+		cairo_set_source_rgba (cr, 0, 0, 0, 1.0);
+		cairo_translate (cr, cx - tc->dx[i], cy - tc->dy[i]);
+		cairo_rotate (cr, a);
+		cairo_translate (cr, 0, -tc->c_rad);
+		cairo_arc (cr, 0, 0, tc->rad, 0, 2 * M_PI);
+		cairo_fill (cr);
+		cairo_destroy (cr);
+		cairo_surface_flush (tc->dot[i]);
+	}
+	return 0;
 }
 
+static void time_circle_free (TimeCircle *tc) {
+	int i;
+	for (i = 0; tc->dot && i < tc->tcn; ++i) {
+		cairo_surface_destroy (tc->dot[i]);
+	}
+	free (tc->dot);
+	free (tc->dx);
+	free (tc->dy);
+}
+
+/* per run, read-only resources shared by all workers */
+typedef struct OverlayCache {
+	GlyphAtlas glyphs;
+	TimeCircle circle;
+} OverlayCache;
+
 static void annotate (cairo_t* cr,
+		PangoFontDescription const *font,
 		const float w, const float h,
-		TimecodeRate *r, const char *text)
+		TimecodeRate const *r, const char *text)
 {
 	char tmp[64];
 
@@ -633,20 +1212,21 @@ static void annotate (cairo_t* cr,
 	const float x0 = sx1 * .25;
 
 	sprintf (tmp, "%.0fx%.0f", w, h);
-	write_text (cr, tmp, x0, i_y0 * .5, 0);
+	write_text (cr, font, tmp, x0, i_y0 * .5, 0, NULL);
 
 	sprintf (tmp, "%.3f fps", (r->fps.num / (float)r->fps.den));
-	write_text (cr, tmp, w - x0, i_y0 *.5, 1);
+	write_text (cr, font, tmp, w - x0, i_y0 *.5, 1, NULL);
 
 	if (strlen (text) > 0) {
-		write_text (cr, text, w * .5, i_y0 * .5, -1);
+		write_text (cr, font, text, w * .5, i_y0 * .5, -1, NULL);
 	}
 }
 
 static void splash (cairo_t* cr,
+		PangoFontDescription const *font,
 		const float w, const float h,
-		TimecodeRate *r, int64_t fn_start, int64_t fn_end,
-		const char *title)
+		TimecodeRate const *r, int64_t fn_start, int64_t fn_end,
+		const char *title, DirtyRegion *dirty)
 {
 	TimecodeTime tc;
 	char tmp[64];
@@ -664,26 +1244,27 @@ static void splash (cairo_t* cr,
 	int lo = strlen (title) > 0 ? 0 : h/22;
 
 	sprintf (tmp, "Start: %s", tcs);
-	write_text (cr, tmp, x0, y0 - ln + lo, -1);
+	write_text (cr, font, tmp, x0, y0 - ln + lo, -1, dirty);
 
 	sprintf (tmp, "End:   %s", tce);
-	write_text (cr, tmp, x0, y0 + lo, -1);
+	write_text (cr, font, tmp, x0, y0 + lo, -1, dirty);
 
 	if (strlen (title) > 0) {
-		write_text (cr, title, x0, y0 + ln, -1);
+		write_text (cr, font, title, x0, y0 + ln, -1, dirty);
 	}
 }
 
 
 static void timecode (cairo_t* cr,
 		const float w, const float h,
-		TimecodeRate *r,
-		int64_t fn
+		TimecodeRate const *r,
+		int64_t fn,
+		OverlayCache const *cache,
+		DirtyRegion *dirty
 		)
 {
 
 	int64_t i;
-	char tmp[64];
 
 	const float cx = w * .5;
 	const float cy = h * .5;
@@ -697,21 +1278,22 @@ static void timecode (cairo_t* cr,
 	float x0, x1;
 	float y0, y1;
 
-	int tcn = ceil (r->fps.num / (double)r->fps.den);
-	int tcm = 1;
-	if (tcn < 40) {
-		tcn *= 2;
-		tcm = 2;
-	}
+	int tcn, tcm;
+	float c_rad, rad;
+	time_circle_geometry (r, h, &tcn, &tcm, &c_rad, &rad);
+
 	// TIME CIRCLE
-	const float c_rad = h / 2.9;
-	float rad = M_PI * c_rad / (tcn * 6. / 5.);
 	for (i = 0; i < tcn; ++i) {
-		cairo_save (cr);
 		const float col = (tcn - i) / (float) tcn;
+		const int pos = (i + 1 + tcm * fn) % tcn;
 		cairo_set_source_rgba (cr, col, col, col, .4);
+		if (cache) {
+			cairo_mask_surface (cr, cache->circle.dot[pos], cache->circle.dx[pos], cache->circle.dy[pos]);
+			continue;
+		}
+		cairo_save (cr);
 		cairo_translate (cr, cx, cy);
-		cairo_rotate (cr, 2 * M_PI * ((i + 1 + tcm * fn) % tcn)  / (float)tcn);
+		cairo_rotate (cr, 2 * M_PI * pos / (float)tcn);
 		cairo_translate (cr, 0, -c_rad);
 		cairo_arc (cr, 0, 0, rad, 0, 2 * M_PI);
 		cairo_fill (cr);
@@ -723,12 +1305,16 @@ static void timecode (cairo_t* cr,
 	cairo_set_line_width (cr, 1.2);
 	cairo_stroke (cr);
 
+	dirty_add (dirty, cx - c_rad, cy - c_rad, cx + c_rad, cy + c_rad, MAX(rad, .6) + 2);
+
 	// b/w box to indicate frame progression
 	y0 = floor(i_y1 - sy1 * .5);
 	y1 = ceil(sy1 * .3);
 	x0 = sx1 * .25;
 	x1 = sx1 * .5;
 
+	dirty_add (dirty, rint (x0), y0, rint (x0 + 2 * x1), y0 + 2 * y1, 1);
+
 	for (i = 0; i < 2; ++i) {
 		if ((i + fn) % 2) {
 			cairo_set_source_rgba (cr, 0, 0, 0, 0.7);
@@ -752,205 +1338,3732 @@ static void timecode (cairo_t* cr,
 		cairo_rectangle (cr, rint (x0 + i * x1), y0, r, y1);
 		cairo_fill (cr);
 	}
+}
+
+static void timecode_text (cairo_t* cr,
+		PangoFontDescription const *font,
+		const float w, const float h,
+		TimecodeRate const *r,
+		int64_t fn,
+		OverlayCache const *cache,
+		DirtyRegion *dirty
+		)
+{
+	char tmp[64];
+
+	const float i_x0 = w / 8.;
+	const float i_x1 = w * 7. / 8.;
+	const float i_y1 = h * 11. / 12.;
+	const float sx1  = (i_x1 - i_x0) / 6.;
+	const float x0 = sx1 * .25;
 
 	// timecode & framenumber
 	sprintf (tmp, "%"PRId64, fn);
-	write_text (cr, tmp, x0, i_y1 + 4, 0);
+	if (write_text_cached (cr, cache ? &cache->glyphs : NULL, tmp, x0, i_y1 + 4, 0, dirty)) {
+		write_text (cr, font, tmp, x0, i_y1 + 4, 0, dirty);
+	}
 
 	TimecodeTime tc;
 	framenumber_to_timecode (&tc, r, fn);
 	format_tc (tmp, r, &tc);
-	write_text (cr, tmp, w - x0, i_y1 + 4, 1);
+	if (write_text_cached (cr, cache ? &cache->glyphs : NULL, tmp, w - x0, i_y1 + 4, 1, dirty)) {
+		write_text (cr, font, tmp, w - x0, i_y1 + 4, 1, dirty);
+	}
 }
 
-#ifdef CUSTOM_PNG_WRITER
-/*** custom png writer
- * zlib deflate in cairo_surface_write_to_png() is the performance bottleneck
- * also, the image is known to be flat - no alpha layer.
+/*** motion patterns
+ * Optional moving content for judder, cadence and deinterlacer tests. It is
+ * rendered for every frame into the inner area of the test-screen, below the
+ * overlay. Selected patterns share the area in horizontal bands:
+ *  - bar: a white bar on black, moving by a constant number of pixels per frame
+ *  - zone plate: concentric rings up to the Nyquist frequency, moving inwards
+ *  - sweep: horizontal frequency sweep, moving right by one pixel per frame
  */
-#if 0 // replacement for png_set_bgr()
-static void convert_to_rgb (png_structp png, png_row_infop row_info, png_bytep data) {
-	unsigned int i, j;
-	for (i = 0; i < row_info->rowbytes; i += 4, j += 3) {
-		uint8_t *b = &data[i];
-		uint32_t p;
-
-		memcpy (&p, &data[i], sizeof (uint32_t));
-
-		b[0] = (p & 0xff0000) >> 16;
-		b[1] = (p & 0x00ff00) >>  8;
-		b[2] = (p & 0x0000ff) >>  0;
+#define MOTION_BAR   0x08
+#define MOTION_ZONE  0x10
+#define MOTION_SWEEP 0x20
+#define MOTION_MASK  (MOTION_BAR | MOTION_ZONE | MOTION_SWEEP)
+
+typedef struct MotionBand {
+	int kind;     ///< MOTION_BAR, MOTION_ZONE or MOTION_SWEEP
+	int x, y, w, h;
+} MotionBand;
+
+typedef struct Motion {
+	int n;
+	MotionBand band[3];
+	int bar_w;    ///< width of the bar
+	int bar_step; ///< bar motion per frame
+} Motion;
+
+static void motion_init (Motion *m, const float w, const float h, const uint8_t mode, TimecodeRate const *r) {
+	const int kinds[3] = { MOTION_BAR, MOTION_ZONE, MOTION_SWEEP };
+	const int i_x0 = rint (w / 8.);
+	const int i_x1 = rint (w * 7. / 8.);
+	const int i_y0 = rint (h / 12.);
+	const int i_y1 = rint (h * 11. / 12.);
+	int i, n = 0;
+
+	memset (m, 0, sizeof (Motion));
+	for (i = 0; i < 3; ++i) {
+		if (mode & kinds[i]) {
+			m->band[m->n++].kind = kinds[i];
+		}
 	}
+	for (i = 0; i < m->n; ++i, ++n) {
+		MotionBand *b = &m->band[i];
+		b->x = i_x0;
+		b->w = i_x1 - i_x0;
+		b->y = i_y0 + (i_y1 - i_y0) * n / m->n;
+		b->h = i_y0 + (i_y1 - i_y0) * (n + 1) / m->n - b->y;
+	}
+	/* cross the area in about two seconds */
+	m->bar_w = MAX(4, (i_x1 - i_x0) / 32);
+	m->bar_step = MAX(1, rint ((i_x1 - i_x0) * r->fps.den / (2. * r->fps.num)));
 }
+
+/* gray pixels from cos (A + B) = cos A cos B - sin A sin B, per column A and per row B */
+static void zone_row (uint32_t *p, const float *ca, const float *sa, const float cb, const float sb, const int n) {
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i alpha = _mm_set1_epi32 (0xff000000);
+	const __m128 half = _mm_set1_ps (127.5f);
+	const __m128 vcb  = _mm_set1_ps (cb);
+	const __m128 vsb  = _mm_set1_ps (sb);
+	for (; i + 4 <= n; i += 4) {
+		const __m128 c = _mm_sub_ps (_mm_mul_ps (_mm_loadu_ps (ca + i), vcb), _mm_mul_ps (_mm_loadu_ps (sa + i), vsb));
+		const __m128i v = _mm_cvtps_epi32 (_mm_add_ps (_mm_mul_ps (c, half), half));
+		_mm_storeu_si128 ((__m128i*) (p + i), _mm_or_si128 (
+					_mm_or_si128 (v, _mm_slli_epi32 (v, 8)),
+					_mm_or_si128 (_mm_slli_epi32 (v, 16), alpha)));
+	}
 #endif
+	for (; i < n; ++i) {
+		const float c = ca[i] * cb - sa[i] * sb;
+		const uint32_t v = lrintf (c * 127.5f + 127.5f);
+		p[i] = 0xff000000 | v << 16 | v << 8 | v;
+	}
+}
 
-static int write_png (cairo_surface_t *cs, const char *filename, int compression) {
-	int i;
+static int motion_band (MotionBand const *b, Motion const *m, uint32_t *d, const int stride, const int64_t fn) {
+	uint32_t *row0 = d + (size_t)b->y * stride + b->x;
+	int x, y;
+
+	if (b->kind == MOTION_BAR) {
+		const int64_t pos = (fn * m->bar_step) % (b->w + m->bar_w) - m->bar_w;
+		const int x0 = MAX(0, pos);
+		const int x1 = MIN(b->w, pos + m->bar_w);
+		for (y = 0; y < b->h; ++y) {
+			uint32_t *p = row0 + (size_t)y * stride;
+			for (x = 0; x < b->w; ++x) {
+				p[x] = (x >= x0 && x < x1) ? 0xffffffff : 0xff000000;
+			}
+		}
+		return 0;
+	}
+
+	float *ca = malloc (b->w * 2 * sizeof (float));
+	if (!ca) {
+		return -1;
+	}
+	float *sa = ca + b->w;
+
+	if (b->kind == MOTION_SWEEP) {
+		/* 0 .. 0.5 cycles per pixel */
+		const int64_t shift = fn % b->w;
+		for (x = 0; x < b->w; ++x) {
+			const int64_t xs = (x + b->w - shift) % b->w;
+			ca[x] = cos (M_PI * xs * xs / (2. * b->w));
+			sa[x] = 0;
+		}
+		zone_row (row0, ca, sa, 1.f, 0.f, b->w);
+		for (y = 1; y < b->h; ++y) {
+			memcpy (row0 + (size_t)y * stride, row0, b->w * sizeof (uint32_t));
+		}
+	} else {
+		/* phase pi * r^2 / (2 R): 0.5 cycles per pixel at r = R */
+		const double k = M_PI / MAX(b->w, b->h);
+		const double t = M_PI * (fn % 8) / 4.;
+		for (x = 0; x < b->w; ++x) {
+			const double dx = x + .5 - b->w * .5;
+			ca[x] = cos (k * dx * dx + t);
+			sa[x] = sin (k * dx * dx + t);
+		}
+		for (y = 0; y < b->h; ++y) {
+			const double dy = y + .5 - b->h * .5;
+			zone_row (row0 + (size_t)y * stride, ca, sa, cos (k * dy * dy), sin (k * dy * dy), b->w);
+		}
+	}
+	free (ca);
+	return 0;
+}
+
+static int motion_render (Motion const *m, cairo_surface_t *cs, const int64_t fn, DirtyRegion *dirty) {
+	uint32_t *d = (uint32_t*) cairo_image_surface_get_data (cs);
+	const int stride = cairo_image_surface_get_stride (cs) / 4;
+	int i, rv = 0;
+
+	cairo_surface_flush (cs);
+	/* these must be the first areas, see restore_bg () */
+	for (i = 0; i < m->n; ++i) {
+		MotionBand const *b = &m->band[i];
+		rv |= motion_band (b, m, d, stride, fn);
+		dirty_add (dirty, b->x, b->y, b->x + b->w, b->y + b->h, 0);
+	}
+	cairo_surface_mark_dirty (cs);
+	return rv;
+}
+
+/*** frame renderer
+ * everything needed to render any frame of a sequence. Used by the render
+ * threads of the command-line application and by the library interface.
+ */
+struct Tsmm2Context {
+	float w, h;
+	TimecodeRate rate;
+	uint8_t mode;
+	int64_t fn_start;
+	int64_t fn_end;
+	char title[128];
+	PangoFontDescription *font;
+	OverlayCache cache;
+	Motion motion;
+	cairo_surface_t *bg;     ///< test-screen with annotations
+	Tsmm2PixelFormat format; ///< library: layout of the caller's buffer
+	int own_font;            ///< library: font and glyph cells belong to the context
+};
+
+/* set up the time circle, motion and background, from `pattern` and `text`.
+ * All other fields are filled in by the caller.
+ */
+static int frame_context_init (Tsmm2Context *c, cairo_surface_t *pattern, const char *text) {
+	if (time_circle_init (&c->cache.circle, c->w, c->h, &c->rate)) {
+		return -1;
+	}
+	motion_init (&c->motion, c->w, c->h, c->mode, &c->rate);
+
+	c->bg = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, c->w, c->h);
+	cairo_t* cr = cairo_create (c->bg);
+	cairo_set_source_surface (cr, pattern, 0, 0);
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint (cr);
+	cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+	annotate (cr, c->font, c->w, c->h, &c->rate, text);
+	cairo_destroy (cr);
+	return 0;
+}
+
+static void frame_context_release (Tsmm2Context *c) {
+	if (c->bg) {
+		cairo_surface_destroy (c->bg);
+	}
+	time_circle_free (&c->cache.circle);
+	if (c->own_font) {
+		glyph_atlas_free (&c->cache.glyphs);
+		pango_font_description_free (c->font);
+	}
+}
+
+/* draw frame `i` of the sequence. The background must already be in place,
+ * except for the motion areas. Changed areas are added to `dirty`, the
+ * time of each step since `*t` is counted in `ps` and `*t` is updated.
+ */
+static int frame_draw (Tsmm2Context const *c, cairo_t* cr, cairo_surface_t *cs, const int64_t i,
+		DirtyRegion *dirty, PerfStats *ps, uint64_t *t)
+{
+	const int64_t fn = i + c->fn_start;
+	uint64_t t1 = *t;
 	int rv = 0;
-	unsigned char * img_data;
-	FILE *x;
-	const int w = cairo_image_surface_get_width (cs);
-	const int h = cairo_image_surface_get_height (cs);
-	const int s = cairo_image_surface_get_stride (cs);
 
-	if (cairo_image_surface_get_format (cs) != CAIRO_FORMAT_ARGB32) {
-		fprintf (stderr, "unsupported image format\n");
+	if (c->motion.n > 0) {
+		rv = motion_render (&c->motion, cs, fn, dirty);
+		t1 = perf_add (ps, PERF_MOTION, t1);
+	}
+
+	timecode (cr, c->w, c->h, &c->rate, fn, &c->cache, dirty);
+	t1 = perf_add (ps, PERF_OVERLAY, t1);
+
+	timecode_text (cr, c->font, c->w, c->h, &c->rate, fn, &c->cache, dirty);
+	if (i == 0) {
+		splash (cr, c->font, c->w, c->h, &c->rate, c->fn_start, c->fn_end, c->title, dirty);
+	}
+	*t = perf_add (ps, PERF_TEXT, t1);
+	return rv;
+}
+
+/*** library interface, see tsmm2.h */
+
+#if TSMM2_MOTION_BAR != MOTION_BAR || TSMM2_MOTION_ZONE != MOTION_ZONE || TSMM2_MOTION_SWEEP != MOTION_SWEEP
+#error "tsmm2.h motion flags do not match"
+#endif
+
+void tsmm2_settings_init (Tsmm2Settings *s) {
+	memset (s, 0, sizeof (Tsmm2Settings));
+	s->height = 360;
+	s->fps_num = 25;
+	s->fps_den = 1;
+	s->frames = 125;
+	s->flags = TSMM2_STRIPES;
+	s->format = TSMM2_ARGB32;
+}
+
+/* geometry, rate, mode and title of the sequence, all settings are valid */
+static void frame_context_settings (Tsmm2Context *c, Tsmm2Settings const *s) {
+	c->h = s->height;
+	c->w = s->width > 0 ? s->width : rintf (c->h * 16 / 9.f);
+	c->rate.fps.num = s->fps_num;
+	c->rate.fps.den = s->fps_den;
+	c->rate.drop = rintf (100. * s->fps_num / (float)s->fps_den) == 2997;
+	c->mode = s->flags & (TSMM2_STRIPES | TSMM2_SMPTE_HDV | TSMM2_NO_BORDER | MOTION_MASK);
+	c->fn_start = s->start_frame;
+	c->fn_end = s->start_frame + s->frames;
+	snprintf (c->title, sizeof (c->title), "%s", s->title ? s->title : "");
+	c->format = s->format;
+}
+
+Tsmm2Context *tsmm2_context_create (Tsmm2Settings const *s) {
+	char font[128];
+
+	if (s->height < 80 || (s->width != 0 && s->width < 80)
+			|| s->fps_num < 1 || s->fps_den < 1 || s->fps_num < s->fps_den
+			|| s->frames < 1 || s->format < TSMM2_ARGB32 || s->format > TSMM2_BGR) {
+		return NULL;
+	}
+
+	Tsmm2Context *c = calloc (1, sizeof (Tsmm2Context));
+	if (!c) {
+		return NULL;
+	}
+
+	frame_context_settings (c, s);
+
+	snprintf (font, sizeof (font), "%s %d", s->font ? s->font : FONTFILE, MAX(6, (int)rint (c->h / 22)));
+	c->font = pango_font_description_from_string (font);
+	text_resolve_font (c->font);
+	glyph_atlas_init (&c->cache.glyphs, c->font);
+	c->own_font = 1;
+
+	cairo_surface_t *pattern = test_pattern (c->w, c->h, c->mode);
+	const int rv = frame_context_init (c, pattern, s->text ? s->text : "");
+	cairo_surface_destroy (pattern);
+
+	if (rv) {
+		tsmm2_context_free (c);
+		return NULL;
+	}
+	return c;
+}
+
+/* copy a row of opaque ARGB32 pixels to the caller's format */
+static void frame_row (const uint32_t *s, uint8_t *d, const int w, const Tsmm2PixelFormat f) {
+	int x;
+	switch (f) {
+		case TSMM2_ARGB32:
+			memcpy (d, s, w * sizeof (uint32_t));
+			break;
+		case TSMM2_RGBA:
+			for (x = 0; x < w; ++x, d += 4) {
+				d[0] = CH_R(s[x]); d[1] = CH_G(s[x]); d[2] = CH_B(s[x]); d[3] = 0xff;
+			}
+			break;
+		case TSMM2_BGRA:
+			for (x = 0; x < w; ++x, d += 4) {
+				d[0] = CH_B(s[x]); d[1] = CH_G(s[x]); d[2] = CH_R(s[x]); d[3] = 0xff;
+			}
+			break;
+		case TSMM2_RGB:
+			for (x = 0; x < w; ++x, d += 3) {
+				d[0] = CH_R(s[x]); d[1] = CH_G(s[x]); d[2] = CH_B(s[x]);
+			}
+			break;
+		case TSMM2_BGR:
+			for (x = 0; x < w; ++x, d += 3) {
+				d[0] = CH_B(s[x]); d[1] = CH_G(s[x]); d[2] = CH_R(s[x]);
+			}
+			break;
+	}
+}
+
+int tsmm2_render_frame (Tsmm2Context const *c, int64_t fn, uint8_t *buffer, int stride) {
+	const int w = c->w;
+	const int h = c->h;
+	const int bpp = (c->format == TSMM2_RGB || c->format == TSMM2_BGR) ? 3 : 4;
+	cairo_surface_t *cs;
+	DirtyRegion dirty;
+	int y;
+
+	if (fn < 0 || fn >= c->fn_end - c->fn_start || !buffer || stride < w * bpp) {
+		return -1;
+	}
+
+	/* aligned ARGB32 buffers are rendered to directly */
+	const int direct = c->format == TSMM2_ARGB32 && stride % 4 == 0 && (uintptr_t)buffer % 4 == 0;
+	if (direct) {
+		cs = cairo_image_surface_create_for_data (buffer, CAIRO_FORMAT_ARGB32, w, h, stride);
+	} else {
+		cs = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, w, h);
+	}
+	if (cairo_surface_status (cs) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy (cs);
+		return -1;
+	}
+
+	cairo_t* cr = cairo_create (cs);
+	cairo_set_source_surface (cr, c->bg, 0, 0);
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint (cr);
+	cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+	uint64_t t = perf_now ();
+	dirty.n = 0;
+	const int rv = frame_draw (c, cr, cs, fn, &dirty, NULL, &t);
+	cairo_destroy (cr);
+	cairo_surface_flush (cs);
+
+	if (!direct) {
+		const uint8_t *src = cairo_image_surface_get_data (cs);
+		const int src_stride = cairo_image_surface_get_stride (cs);
+		for (y = 0; y < h; ++y) {
+			frame_row ((const uint32_t*) (src + (size_t)y * src_stride), buffer + (size_t)y * stride, w, c->format);
+		}
+	}
+	cairo_surface_destroy (cs);
+	return rv ? -1 : 0;
+}
+
+void tsmm2_frame_size (Tsmm2Context const *c, int *width, int *height) {
+	*width = c->w;
+	*height = c->h;
+}
+
+void tsmm2_context_free (Tsmm2Context *c) {
+	if (!c) {
+		return;
+	}
+	frame_context_release (c);
+	free (c);
+}
+
+#ifndef TSMM2_LIBRARY
+/* everything below is the command-line application */
+
+#ifdef CUSTOM_PNG_WRITER
+/*** custom png writer
+ * zlib deflate in cairo_surface_write_to_png() is the performance bottleneck
+ * also, the image is known to be flat - no alpha layer.
+ *
+ * The image is deflated in bands of rows, each band is an independent
+ * raw deflate sequence ending on a full flush boundary, so that bands can be
+ * concatenated into a single zlib stream. Most bands are identical to the
+ * static background: those are compressed once and re-used for every frame,
+ * only bands touched by the overlay are compressed per frame.
+ *
+ * Since bands are independent, the bands of a single image can also be
+ * compressed concurrently (pigz style) by several deflate lanes. This helps
+ * with very large images, where a single frame takes a long time to compress.
+ *
+ * For --overlay, the image is a cropped part of a transparent frame, written
+ * as RGBA with its position in an oFFs chunk.
+ */
+
+#define PNG_BAND_ROWS 16
+
+/* compressed image data */
+typedef struct PngBands {
+	int w, h;
+	int x, y;            ///< position of the image in the frame, RGBA only
+	int channels;        ///< 3: RGB, 4: RGBA
+	int level;
+	int n;               ///< number of bands
+	const uint8_t **ptr; ///< compressed band data
+	size_t *len;         ///< compressed band length
+	uLong *adler;        ///< adler32 of the filtered band
+	size_t *raw_len;     ///< length of the filtered band
+	uLong *crc;          ///< crc32 of the compressed band
+	uint8_t *arena;      ///< storage for the bands compressed for this image,
+	                     ///< others point to the bands of the reference image
+	int n_slots;         ///< number of bands the arena can hold
+	size_t slot;         ///< arena size per band
+} PngBands;
+
+struct PngEncoder;
+
+typedef struct PngLane {
+	struct PngEncoder *pe;
+	uint8_t *raw;        ///< scratch, filtered rows of one band
+	z_stream zs;
+	int zinit;
+	pthread_t thread;
+} PngLane;
+
+/* per thread compressor state. Lanes other than the first are helper
+ * threads, started once and woken for every image with more than one band
+ * to compress.
+ */
+typedef struct PngEncoder {
+	int lanes;           ///< number of concurrent deflate lanes
+	PngLane *lane;
+	int helpers;         ///< running helper threads, lane[1 .. helpers]
+	pthread_mutex_t lock;
+	pthread_cond_t work; ///< a new image is ready, or quit
+	pthread_cond_t idle; ///< all helpers are done with the image
+	int64_t gen;         ///< image counter
+	int busy;            ///< helpers still working on the image
+	int quit;
+	/* current image */
+	PngBands *pb;
+	const uint8_t *img_data;
+	int stride;
+	int *todo;           ///< bands to compress
+	int n_todo;
+	int cursor;          ///< next entry in todo, shared by lanes
+	int error;
+} PngEncoder;
+
+static int png_level (const int compression) {
+	return (compression >= 0 && compression <= 9) ? compression : Z_DEFAULT_COMPRESSION;
+}
+
+static size_t png_band_raw_size (const int w, const int channels) {
+	return (size_t)PNG_BAND_ROWS * (1 + channels * w);
+}
+
+static void png_bands_free (PngBands *pb) {
+	free (pb->ptr);
+	free (pb->len);
+	free (pb->adler);
+	free (pb->raw_len);
+	free (pb->crc);
+	free (pb->arena);
+	memset (pb, 0, sizeof (PngBands));
+}
+
+static int png_bands_init (PngBands *pb, const int w, const int h, const int compression, const int channels) {
+	memset (pb, 0, sizeof (PngBands));
+	pb->w = w;
+	pb->h = h;
+	pb->channels = channels;
+	pb->level = png_level (compression);
+	pb->n = (h + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+	/* + sync flush marker and some slack per band */
+	pb->slot = compressBound (png_band_raw_size (w, channels)) + 64;
+
+	pb->ptr     = calloc (pb->n, sizeof (uint8_t*));
+	pb->len     = calloc (pb->n, sizeof (size_t));
+	pb->adler   = calloc (pb->n, sizeof (uLong));
+	pb->raw_len = calloc (pb->n, sizeof (size_t));
+	pb->crc     = calloc (pb->n, sizeof (uLong));
+
+	if (!pb->ptr || !pb->len || !pb->adler || !pb->raw_len || !pb->crc) {
+		png_bands_free (pb);
+		return -1;
+	}
+	return 0;
+}
+
+/* use only the area `r` of the next frame, within the size given to png_bands_init() */
+static void png_bands_crop (PngBands *pb, Rect const *r) {
+	pb->x = r->x;
+	pb->y = r->y;
+	pb->w = r->w;
+	pb->h = r->h;
+	pb->n = (r->h + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+}
+
+static void png_encoder_free (PngEncoder *pe) {
+	int l;
+	if (pe->helpers > 0) {
+		pthread_mutex_lock (&pe->lock);
+		pe->quit = 1;
+		pthread_cond_broadcast (&pe->work);
+		pthread_mutex_unlock (&pe->lock);
+		for (l = 1; l <= pe->helpers; ++l) {
+			pthread_join (pe->lane[l].thread, NULL);
+		}
+	}
+	if (pe->lane) {
+		pthread_mutex_destroy (&pe->lock);
+		pthread_cond_destroy (&pe->work);
+		pthread_cond_destroy (&pe->idle);
+	}
+	for (l = 0; pe->lane && l < pe->lanes; ++l) {
+		if (pe->lane[l].zinit) {
+			deflateEnd (&pe->lane[l].zs);
+		}
+		free (pe->lane[l].raw);
+	}
+	free (pe->lane);
+	free (pe->todo);
+	memset (pe, 0, sizeof (PngEncoder));
+}
+
+static void * png_lane_thread (void *arg);
+
+static int png_encoder_init (PngEncoder *pe, const int w, const int h, const int compression, const int channels, const int lanes) {
+	int l;
+	const int level = png_level (compression);
+	const int n = (h + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+
+	memset (pe, 0, sizeof (PngEncoder));
+	pe->lanes = MAX(1, MIN(lanes, n));
+	pe->lane = calloc (pe->lanes, sizeof (PngLane));
+	pe->todo = calloc (n, sizeof (int));
+	if (!pe->lane || !pe->todo) {
+		free (pe->lane);
+		free (pe->todo);
+		memset (pe, 0, sizeof (PngEncoder));
+		return -1;
+	}
+	pthread_mutex_init (&pe->lock, NULL);
+	pthread_cond_init (&pe->work, NULL);
+	pthread_cond_init (&pe->idle, NULL);
+	for (l = 0; l < pe->lanes; ++l) {
+		PngLane *pl = &pe->lane[l];
+		pl->pe = pe;
+		if (deflateInit2 (&pl->zs, level, Z_DEFLATED, -15, 8, level == 0 ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK) {
+			png_encoder_free (pe);
+			return -1;
+		}
+		pl->zinit = 1;
+		if (!(pl->raw = malloc (png_band_raw_size (w, channels)))) {
+			png_encoder_free (pe);
+			return -1;
+		}
+	}
+	/* fewer helpers just make the lanes slower */
+	for (l = 1; l < pe->lanes; ++l) {
+		if (pthread_create (&pe->lane[l].thread, NULL, png_lane_thread, &pe->lane[l])) {
+			break;
+		}
+		pe->helpers = l;
+	}
+	return 0;
+}
+
+/* RGBA rows [y0, y1) as straight (not premultiplied) alpha, filtered in place.
+ * Rows are filtered bottom-up, so that the row above is still unfiltered.
+ * return the end of the filtered data.
+ */
+static uint8_t *png_band_rgba (const uint8_t *img, const int stride, PngBands const *pb, const int y0, const int y1, uint8_t *d) {
+	const size_t len = 1 + 4 * pb->w;
+	int x, y;
+
+	for (y = y0; y < y1; ++y) {
+		const uint32_t *row = (const uint32_t*) (img + y * stride);
+		uint8_t *p = d + (y - y0) * len;
+		*p++ = pb->level == 0 ? 0 : (y == y0 ? 1 : 2); // None, Sub, Up
+		for (x = 0; x < pb->w; ++x, p += 4) {
+			const uint32_t a = row[x] >> 24;
+			if (a == 0) {
+				p[0] = p[1] = p[2] = p[3] = 0;
+			} else if (a == 0xff) {
+				p[0] = CH_R(row[x]);
+				p[1] = CH_G(row[x]);
+				p[2] = CH_B(row[x]);
+				p[3] = 0xff;
+			} else {
+				p[0] = (CH_R(row[x]) * 255 + a / 2) / a;
+				p[1] = (CH_G(row[x]) * 255 + a / 2) / a;
+				p[2] = (CH_B(row[x]) * 255 + a / 2) / a;
+				p[3] = a;
+			}
+		}
+	}
+
+	if (pb->level > 0) {
+		uint8_t *p;
+		for (y = y1 - 1; y > y0; --y) {
+			p = d + (y - y0) * len + 1;
+			const uint8_t *above = p - len;
+			for (x = 0; x < 4 * pb->w; ++x) {
+				p[x] -= above[x];
+			}
+		}
+		p = d + 1;
+		for (x = 4 * pb->w - 1; x >= 4; --x) {
+			p[x] -= p[x - 4];
+		}
+	}
+	return d + (y1 - y0) * len;
+}
+
+/* filter rows of band `b` and deflate them.
+ * The first row of a band uses the 'Sub' filter, all others 'Up',
+ * so that a band does not depend on pixels outside of it.
+ */
+static int png_band_deflate (PngLane *pl, const int b, uint8_t *out) {
+	int x, y;
+	PngEncoder *pe = pl->pe;
+	PngBands *pb = pe->pb;
+	const int y0 = b * PNG_BAND_ROWS;
+	const int y1 = MIN(pb->h, y0 + PNG_BAND_ROWS);
+	uint8_t *d = pl->raw;
+	const uint64_t t0 = trace_begin ();
+
+	if (pb->channels == 4) {
+		d = png_band_rgba (pe->img_data, pe->stride, pb, y0, y1, d);
+	} else for (y = y0; y < y1; ++y) {
+		const uint32_t *row = (const uint32_t*) (pe->img_data + y * pe->stride);
+		const uint32_t *above = (const uint32_t*) (pe->img_data + (y - 1) * pe->stride);
+		if (pb->level == 0) {
+			*d++ = 0; // None
+			for (x = 0; x < pb->w; ++x) {
+				*d++ = CH_R(row[x]);
+				*d++ = CH_G(row[x]);
+				*d++ = CH_B(row[x]);
+			}
+		} else if (y == y0) {
+			uint32_t prev = 0;
+			*d++ = 1; // Sub
+			for (x = 0; x < pb->w; ++x) {
+				*d++ = CH_R(row[x]) - CH_R(prev);
+				*d++ = CH_G(row[x]) - CH_G(prev);
+				*d++ = CH_B(row[x]) - CH_B(prev);
+				prev = row[x];
+			}
+		} else {
+			*d++ = 2; // Up
+			for (x = 0; x < pb->w; ++x) {
+				*d++ = CH_R(row[x]) - CH_R(above[x]);
+				*d++ = CH_G(row[x]) - CH_G(above[x]);
+				*d++ = CH_B(row[x]) - CH_B(above[x]);
+			}
+		}
+	}
+
+	pb->raw_len[b] = d - pl->raw;
+	pb->adler[b] = adler32 (adler32 (0, NULL, 0), pl->raw, pb->raw_len[b]);
+
+	if (deflateReset (&pl->zs) != Z_OK) {
+		return -1;
+	}
+	pl->zs.next_in   = pl->raw;
+	pl->zs.avail_in  = pb->raw_len[b];
+	pl->zs.next_out  = out;
+	pl->zs.avail_out = pb->slot;
+
+	if (deflate (&pl->zs, Z_FULL_FLUSH) != Z_OK || pl->zs.avail_in != 0 || pl->zs.avail_out == 0) {
+		return -1;
+	}
+
+	pb->ptr[b] = out;
+	pb->len[b] = pb->slot - pl->zs.avail_out;
+	pb->crc[b] = crc32 (crc32 (0, NULL, 0), out, pb->len[b]);
+	trace_end ("deflate", t0);
+	return 0;
+}
+
+/* claim and compress bands until none are left */
+static void * png_lane_run (void *arg) {
+	PngLane *pl = (PngLane*) arg;
+	PngEncoder *pe = pl->pe;
+	int t;
+	while ((t = __sync_fetch_and_add (&pe->cursor, 1)) < pe->n_todo) {
+		if (png_band_deflate (pl, pe->todo[t], pe->pb->arena + t * pe->pb->slot)) {
+			pe->error = 1;
+		}
+	}
+	return NULL;
+}
+
+/* helper lane, compress bands of every new image until told to quit */
+static void * png_lane_thread (void *arg) {
+	PngLane *pl = (PngLane*) arg;
+	PngEncoder *pe = pl->pe;
+	int64_t gen = 0;
+
+	pthread_mutex_lock (&pe->lock);
+	for (;;) {
+		while (pe->gen == gen && !pe->quit) {
+			pthread_cond_wait (&pe->work, &pe->lock);
+		}
+		if (pe->quit) {
+			break;
+		}
+		gen = pe->gen;
+		pthread_mutex_unlock (&pe->lock);
+		png_lane_run (pl);
+		pthread_mutex_lock (&pe->lock);
+		if (--pe->busy == 0) {
+			pthread_cond_signal (&pe->idle);
+		}
+	}
+	pthread_mutex_unlock (&pe->lock);
+	return NULL;
+}
+
+/* compress all bands of the image that are not available from `ref` */
+static int png_bands_encode (PngEncoder *pe, PngBands *pb, cairo_surface_t *cs, PngBands const *ref, DirtyRegion const *dirty) {
+	int b, i;
+
+	if (cairo_image_surface_get_format (cs) != CAIRO_FORMAT_ARGB32) {
+		fprintf (stderr, "unsupported image format\n");
+		return -1;
+	}
+
+	cairo_surface_flush (cs);
+	pe->pb = pb;
+	pe->stride = cairo_image_surface_get_stride (cs);
+	pe->img_data = cairo_image_surface_get_data (cs) + pb->y * pe->stride + pb->x * 4;
+	pe->n_todo = 0;
+	pe->cursor = 0;
+	pe->error = 0;
+
+	for (b = 0; b < pb->n; ++b) {
+		int clean = ref != NULL && dirty != NULL;
+		for (i = 0; clean && i < dirty->n; ++i) {
+			const int y0 = b * PNG_BAND_ROWS;
+			if (dirty->r[i].y < y0 + PNG_BAND_ROWS && dirty->r[i].y + dirty->r[i].h > y0) {
+				clean = 0;
+			}
+		}
+		if (clean) {
+			pb->ptr[b]     = ref->ptr[b];
+			pb->len[b]     = ref->len[b];
+			pb->adler[b]   = ref->adler[b];
+			pb->raw_len[b] = ref->raw_len[b];
+			pb->crc[b]     = ref->crc[b];
+		} else {
+			pe->todo[pe->n_todo++] = b;
+		}
+	}
+
+	/* storage only for the bands that are compressed */
+	if (pe->n_todo > pb->n_slots) {
+		uint8_t *arena = realloc (pb->arena, pe->n_todo * pb->slot);
+		if (!arena) {
+			return -1;
+		}
+		pb->arena = arena;
+		pb->n_slots = pe->n_todo;
+	}
+
+	if (pe->helpers == 0 || pe->n_todo < 2) {
+		png_lane_run (&pe->lane[0]);
+		return pe->error ? -1 : 0;
+	}
+
+	pthread_mutex_lock (&pe->lock);
+	pe->busy = pe->helpers;
+	++pe->gen;
+	pthread_cond_broadcast (&pe->work);
+	pthread_mutex_unlock (&pe->lock);
+
+	png_lane_run (&pe->lane[0]);
+
+	pthread_mutex_lock (&pe->lock);
+	while (pe->busy > 0) {
+		pthread_cond_wait (&pe->idle, &pe->lock);
+	}
+	pthread_mutex_unlock (&pe->lock);
+	return pe->error ? -1 : 0;
+}
+
+/* write compressed image to a file */
+/* A PNG file is written from a small header (signature, IHDR, bKGD,
+ * oFFs for RGBA and the start of IDAT), the compressed bands and a trailer,
+ * without copying the image data. The IDAT crc is combined from the crc of
+ * each band.
+ * An APNG frame is laid out the same way: fcTL and the start of IDAT (first
+ * frame) or fdAT, the bands and the end of the data chunk.
+ */
+#define PNG_HEAD_SIZE (8 + 25 + 18 + 8 + 2)
+#define PNG_OFFS_SIZE (12 + 9)
+#define PNG_TAIL_SIZE (2 + 4 + 4 + 12)
+
+typedef struct PngFile {
+	uint8_t head[PNG_HEAD_SIZE + PNG_OFFS_SIZE];
+	uint8_t tail[PNG_TAIL_SIZE];
+	struct iovec *iov; ///< n_bands + 2 entries
+	int iovcnt;
+	size_t size;       ///< file size
+	uLong crc;         ///< crc32 of the file
+} PngFile;
+
+static int png_file_init (PngFile *pf, PngBands const *pb) {
+	memset (pf, 0, sizeof (PngFile));
+	pf->iov = calloc (pb->n + 2, sizeof (struct iovec));
+	return pf->iov ? 0 : -1;
+}
+
+static void png_file_free (PngFile *pf) {
+	free (pf->iov);
+	pf->iov = NULL;
+}
+
+/* write a complete chunk, return its size */
+static size_t png_chunk (uint8_t *d, const char *type, const uint8_t *data, const png_uint_32 len) {
+	png_save_uint_32 (d, len);
+	memcpy (d + 4, type, 4);
+	if (len > 0) {
+		memcpy (d + 8, data, len);
+	}
+	png_save_uint_32 (d + 8 + len, crc32 (crc32 (0, NULL, 0), d + 4, len + 4));
+	return len + 12;
+}
+
+/* image data chunk at `d` in the head, after all preceding chunks:
+ * IDAT, or fdAT with sequence number `seq` >= 0. Followed by IEND if `iend` is set.
+ */
+static void png_file_data (PngFile *pf, PngBands const *pb, uint8_t *d, const int64_t seq, const int iend) {
+	int b;
+	/* zlib stream: header, bands, final empty block, adler32 */
+	uint8_t zhead[2] = { 0x78, 0x01 };
+	const uint8_t zfinal[2] = { 0x03, 0x00 };
+	uLong adler = adler32 (0, NULL, 0);
+	const size_t seq_len = seq >= 0 ? 4 : 0;
+	const size_t tail_len = PNG_TAIL_SIZE - (iend ? 0 : 12);
+	png_uint_32 data_len = seq_len + sizeof (zhead) + sizeof (zfinal) + 4;
+
+	if (pb->level >= 7) {
+		zhead[1] = 0xda;
+	} else if (pb->level >= 6 || pb->level < 0) {
+		zhead[1] = 0x9c;
+	} else if (pb->level >= 2) {
+		zhead[1] = 0x5e;
+	}
+
+	for (b = 0; b < pb->n; ++b) {
+		adler = adler32_combine (adler, pb->adler[b], pb->raw_len[b]);
+		data_len += pb->len[b];
+	}
+
+	png_save_uint_32 (d, data_len);
+	memcpy (d + 4, seq >= 0 ? "fdAT" : "IDAT", 4);
+	if (seq >= 0) {
+		png_save_uint_32 (d + 8, seq);
+	}
+	memcpy (d + 8 + seq_len, zhead, sizeof (zhead));
+	const size_t head_len = d + 8 + seq_len + sizeof (zhead) - pf->head;
+
+	uLong crc = crc32 (crc32 (0, NULL, 0), d + 4, 4 + seq_len + sizeof (zhead));
+	pf->crc = crc32 (crc32 (0, NULL, 0), pf->head, head_len);
+	pf->iov[0].iov_base = pf->head;
+	pf->iov[0].iov_len  = head_len;
+	for (b = 0; b < pb->n; ++b) {
+		crc = crc32_combine (crc, pb->crc[b], pb->len[b]);
+		pf->crc = crc32_combine (pf->crc, pb->crc[b], pb->len[b]);
+		pf->iov[b + 1].iov_base = (void*) pb->ptr[b];
+		pf->iov[b + 1].iov_len  = pb->len[b];
+	}
+
+	d = pf->tail;
+	memcpy (d, zfinal, sizeof (zfinal));
+	png_save_uint_32 (d + 2, adler);
+	crc = crc32 (crc, d, 6);
+	png_save_uint_32 (d + 6, crc);
+	if (iend) {
+		png_chunk (d + 10, "IEND", NULL, 0);
+	}
+	pf->crc = crc32 (pf->crc, pf->tail, tail_len);
+	pf->iov[pb->n + 1].iov_base = pf->tail;
+	pf->iov[pb->n + 1].iov_len  = tail_len;
+
+	pf->iovcnt = pb->n + 2;
+	pf->size = data_len + head_len + tail_len - seq_len - sizeof (zhead) - sizeof (zfinal) - 4;
+}
+
+/* signature and IHDR of an image with the size and color type of `pb`, return its size */
+static size_t png_header (uint8_t *d, PngBands const *pb, const int w, const int h) {
+	static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	uint8_t ihdr[13];
+
+	png_save_uint_32 (ihdr, w);
+	png_save_uint_32 (ihdr + 4, h);
+	ihdr[8]  = 8; // bit depth
+	ihdr[9]  = pb->channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+	ihdr[10] = PNG_COMPRESSION_TYPE_DEFAULT;
+	ihdr[11] = PNG_FILTER_TYPE_DEFAULT;
+	ihdr[12] = PNG_INTERLACE_NONE;
+
+	memcpy (d, sig, sizeof (sig));
+	return sizeof (sig) + png_chunk (d + sizeof (sig), "IHDR", ihdr, sizeof (ihdr));
+}
+
+/* explicit white balance */
+static size_t png_bkgd (uint8_t *d) {
+	static const uint8_t white[6] = { 0, 0xff, 0, 0xff, 0, 0xff };
+	return png_chunk (d, "bKGD", white, sizeof (white));
+}
+
+static void png_file_prepare (PngFile *pf, PngBands const *pb) {
+	uint8_t offs[9];
+	uint8_t *d = pf->head;
+
+	d += png_header (d, pb, pb->w, pb->h);
+	d += png_bkgd (d);
+	if (pb->channels == 4) {
+		png_save_int_32 (offs, pb->x);
+		png_save_int_32 (offs + 4, pb->y);
+		offs[8] = PNG_OFFSET_PIXEL;
+		d += png_chunk (d, "oFFs", offs, sizeof (offs));
+	}
+	png_file_data (pf, pb, d, -1, 1);
+}
+#endif
+
+/*** file output
+ * The encoded image of a frame is written from a list of buffers,
+ * e.g. the PNG header, compressed bands and trailer, without copying.
+ */
+typedef struct FrameFile {
+	struct iovec *iov;
+	int iovcnt;
+	size_t size;   ///< file size
+	uint32_t crc;  ///< crc32 of the file, 0: not known
+} FrameFile;
+
+#ifdef CUSTOM_PNG_WRITER
+static void frame_file_png (FrameFile *ff, PngFile const *pf) {
+	ff->iov    = pf->iov;
+	ff->iovcnt = pf->iovcnt;
+	ff->size   = pf->size;
+	ff->crc    = pf->crc;
+}
+#endif
+
+/* write iov data starting at file offset `off`, continue after short writes.
+ * Note: this modifies `iov`.
+ */
+static int pwritev_all (const int fd, struct iovec *iov, int cnt, off_t off) {
+	size_t skip = off;
+	while (cnt > 0 && skip >= iov->iov_len) {
+		skip -= iov->iov_len;
+		++iov;
+		--cnt;
+	}
+	if (cnt > 0) {
+		iov->iov_base = (uint8_t*)iov->iov_base + skip;
+		iov->iov_len -= skip;
+	}
+	while (cnt > 0) {
+		ssize_t rv = pwritev (fd, iov, MIN(cnt, IOV_MAX), off);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return -1;
+		}
+		off += rv;
+		while (cnt > 0 && (size_t)rv >= iov->iov_len) {
+			rv -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (uint8_t*)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+	return 0;
+}
+
+/* blocking write of a prepared file */
+static int write_file (FrameFile *ff, const char *filename, const int prealloc) {
+	int rv = 0;
+
+	const uint64_t t_open = trace_begin ();
+	const int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	trace_end ("open", t_open);
+
+#ifdef __linux__
+	if (prealloc) {
+		fallocate (fd, 0, 0, ff->size); // may not be supported, not an error
+	}
+#endif
+
+	if (pwritev_all (fd, ff->iov, ff->iovcnt, 0)) {
+		rv = -1;
+	}
+
+	const uint64_t t_close = trace_begin ();
+	if (close (fd)) {
+		rv = -1;
+	}
+	trace_end ("close", t_close);
+	return rv;
+}
+
+/* user-supplied text in a JSON string */
+static void json_escape (FILE *x, const char *s) {
+	for (; *s; ++s) {
+		const unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			fprintf (x, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf (x, "\\u%04x", c);
+		} else {
+			fputc (c, x);
+		}
+	}
+}
+
+/*** colorspace conversion
+ * cairo ARGB32 (opaque, native endian) to planar Y'CbCr.
+ * Chroma subsampling is done in the same pass, from the sum of the
+ * 2x2 (4:2:0) or 2x1 (4:2:2) block. All paths use identical Q15 fixed point
+ * math, so the SIMD versions produce the same output as the scalar one.
+ */
+
+typedef struct YuvFormat {
+	int chroma; ///< 420, 422 or 444
+	int matrix; ///< 601 or 709
+	int full;   ///< 1: full range (0..255), 0: limited range (16..235/240)
+	int16_t ky[3], ku[3], kv[3]; ///< Q15 R, G, B coefficients, see yuv_init()
+	int (*row) (const uint32_t *, const uint32_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *, const int, struct YuvFormat const *);
+} YuvFormat;
+
+static inline uint8_t clamp8 (const int32_t v) {
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* 4:2:0 and 4:2:2 chroma is computed from 4 values, 4:4:4 from 2 */
+static inline int yuv_chroma_shift (YuvFormat const *f) {
+	return f->chroma == 444 ? 16 : 17;
+}
+
+static inline int32_t yuv_luma_offset (YuvFormat const *f) {
+	return (f->full ? 0 : (16 << 15)) + (1 << 14);
+}
+
+static inline int32_t yuv_chroma_offset (YuvFormat const *f) {
+	const int cs = yuv_chroma_shift (f);
+	return (128 << cs) + (1 << (cs - 1));
+}
+
+/* process one row (4:2:2, 4:4:4: r1 == r0, y1 == NULL) or row-pair (4:2:0),
+ * starting at pixel x. */
+static void yuv_row_c (const uint32_t *r0, const uint32_t *r1,
+		uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+		int x, const int w, YuvFormat const *f)
+{
+	const int sub = f->chroma != 444 ? 1 : 0;
+	const int cs  = yuv_chroma_shift (f);
+	const int32_t yo = yuv_luma_offset (f);
+	const int32_t co = yuv_chroma_offset (f);
+	int i;
+
+	for (i = x; i < w; ++i) {
+		y0[i] = clamp8 ((f->ky[0] * CH_R(r0[i]) + f->ky[1] * CH_G(r0[i]) + f->ky[2] * CH_B(r0[i]) + yo) >> 15);
+		if (y1) {
+			y1[i] = clamp8 ((f->ky[0] * CH_R(r1[i]) + f->ky[1] * CH_G(r1[i]) + f->ky[2] * CH_B(r1[i]) + yo) >> 15);
+		}
+	}
+
+	for (i = x; i < w; i += 1 + sub) {
+		const int i1 = sub ? MIN(i + 1, w - 1) : i;
+		int r = CH_R(r0[i]) + CH_R(r1[i]);
+		int g = CH_G(r0[i]) + CH_G(r1[i]);
+		int b = CH_B(r0[i]) + CH_B(r1[i]);
+		if (sub) {
+			r += CH_R(r0[i1]) + CH_R(r1[i1]);
+			g += CH_G(r0[i1]) + CH_G(r1[i1]);
+			b += CH_B(r0[i1]) + CH_B(r1[i1]);
+		}
+		u[i >> sub] = clamp8 ((f->ku[0] * r + f->ku[1] * g + f->ku[2] * b + co) >> cs);
+		v[i >> sub] = clamp8 ((f->kv[0] * r + f->kv[1] * g + f->kv[2] * b + co) >> cs);
+	}
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define YUV_SIMD
+#include <immintrin.h>
+
+#define YUV_SSE2 __attribute__((target("sse2")))
+#define YUV_AVX2 __attribute__((target("avx2")))
+
+/* 8 pixels -> 16 bit R, G, B */
+YUV_SSE2 static inline void sse2_load (const uint32_t *p, __m128i *r, __m128i *g, __m128i *b) {
+	const __m128i m = _mm_set1_epi32 (0xff);
+	const __m128i p0 = _mm_loadu_si128 ((const __m128i*) p);
+	const __m128i p1 = _mm_loadu_si128 ((const __m128i*) (p + 4));
+	*r = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (p0, 16), m), _mm_and_si128 (_mm_srli_epi32 (p1, 16), m));
+	*g = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (p0,  8), m), _mm_and_si128 (_mm_srli_epi32 (p1,  8), m));
+	*b = _mm_packs_epi32 (_mm_and_si128 (p0, m), _mm_and_si128 (p1, m));
+}
+
+/* (k0 * r + k1 * g + k2 * b + off) >> shift, 8 x 16 bit */
+YUV_SSE2 static inline __m128i sse2_dot3 (const __m128i r, const __m128i g, const __m128i b,
+		const __m128i krg, const __m128i kb, const __m128i off, const __m128i shift)
+{
+	const __m128i z = _mm_setzero_si128 ();
+	__m128i lo = _mm_add_epi32 (_mm_madd_epi16 (_mm_unpacklo_epi16 (r, g), krg), _mm_madd_epi16 (_mm_unpacklo_epi16 (b, z), kb));
+	__m128i hi = _mm_add_epi32 (_mm_madd_epi16 (_mm_unpackhi_epi16 (r, g), krg), _mm_madd_epi16 (_mm_unpackhi_epi16 (b, z), kb));
+	lo = _mm_sra_epi32 (_mm_add_epi32 (lo, off), shift);
+	hi = _mm_sra_epi32 (_mm_add_epi32 (hi, off), shift);
+	return _mm_packs_epi32 (lo, hi);
+}
+
+#define K_RG(K) ((int32_t)(((uint32_t)(uint16_t)(K)[1] << 16) | (uint16_t)(K)[0]))
+#define K_B(K)  ((int32_t)(uint16_t)(K)[2])
+
+YUV_SSE2 static int yuv_row_sse2 (const uint32_t *r0, const uint32_t *r1,
+		uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+		const int w, YuvFormat const *f)
+{
+	int x;
+	const __m128i yrg = _mm_set1_epi32 (K_RG(f->ky));
+	const __m128i yb  = _mm_set1_epi32 (K_B(f->ky));
+	const __m128i urg = _mm_set1_epi32 (K_RG(f->ku));
+	const __m128i ub  = _mm_set1_epi32 (K_B(f->ku));
+	const __m128i vrg = _mm_set1_epi32 (K_RG(f->kv));
+	const __m128i vb  = _mm_set1_epi32 (K_B(f->kv));
+	const __m128i yo  = _mm_set1_epi32 (yuv_luma_offset (f));
+	const __m128i co  = _mm_set1_epi32 (yuv_chroma_offset (f));
+	const __m128i ys  = _mm_cvtsi32_si128 (15);
+	const __m128i cs  = _mm_cvtsi32_si128 (yuv_chroma_shift (f));
+	const __m128i one = _mm_set1_epi16 (1);
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		__m128i ra, ga, ba, rb, gb, bb; // row 0
+		__m128i rc, gc, bc, rd, gd, bd; // row 1
+		sse2_load (r0 + x, &ra, &ga, &ba);
+		sse2_load (r0 + x + 8, &rb, &gb, &bb);
+		sse2_load (r1 + x, &rc, &gc, &bc);
+		sse2_load (r1 + x + 8, &rd, &gd, &bd);
+
+		_mm_storeu_si128 ((__m128i*) (y0 + x), _mm_packus_epi16 (
+					sse2_dot3 (ra, ga, ba, yrg, yb, yo, ys),
+					sse2_dot3 (rb, gb, bb, yrg, yb, yo, ys)));
+		if (y1) {
+			_mm_storeu_si128 ((__m128i*) (y1 + x), _mm_packus_epi16 (
+						sse2_dot3 (rc, gc, bc, yrg, yb, yo, ys),
+						sse2_dot3 (rd, gd, bd, yrg, yb, yo, ys)));
+		}
+
+		/* vertical sum */
+		ra = _mm_add_epi16 (ra, rc); ga = _mm_add_epi16 (ga, gc); ba = _mm_add_epi16 (ba, bc);
+		rb = _mm_add_epi16 (rb, rd); gb = _mm_add_epi16 (gb, gd); bb = _mm_add_epi16 (bb, bd);
+
+		if (f->chroma == 444) {
+			_mm_storeu_si128 ((__m128i*) (u + x), _mm_packus_epi16 (
+						sse2_dot3 (ra, ga, ba, urg, ub, co, cs),
+						sse2_dot3 (rb, gb, bb, urg, ub, co, cs)));
+			_mm_storeu_si128 ((__m128i*) (v + x), _mm_packus_epi16 (
+						sse2_dot3 (ra, ga, ba, vrg, vb, co, cs),
+						sse2_dot3 (rb, gb, bb, vrg, vb, co, cs)));
+		} else {
+			/* horizontal pair sum */
+			const __m128i r = _mm_packs_epi32 (_mm_madd_epi16 (ra, one), _mm_madd_epi16 (rb, one));
+			const __m128i g = _mm_packs_epi32 (_mm_madd_epi16 (ga, one), _mm_madd_epi16 (gb, one));
+			const __m128i b = _mm_packs_epi32 (_mm_madd_epi16 (ba, one), _mm_madd_epi16 (bb, one));
+			const __m128i cu = sse2_dot3 (r, g, b, urg, ub, co, cs);
+			const __m128i cv = sse2_dot3 (r, g, b, vrg, vb, co, cs);
+			_mm_storel_epi64 ((__m128i*) (u + x / 2), _mm_packus_epi16 (cu, cu));
+			_mm_storel_epi64 ((__m128i*) (v + x / 2), _mm_packus_epi16 (cv, cv));
+		}
+	}
+	return x;
+}
+
+/* 16 pixels -> 16 bit R, G, B in natural order */
+YUV_AVX2 static inline void avx2_load (const uint32_t *p, __m256i *r, __m256i *g, __m256i *b) {
+	const __m256i m = _mm256_set1_epi32 (0xff);
+	const __m256i pa = _mm256_loadu_si256 ((const __m256i*) p);
+	const __m256i pb = _mm256_loadu_si256 ((const __m256i*) (p + 8));
+	/* packs works per 128bit lane, pre-arrange [0-3, 8-11] [4-7, 12-15] */
+	const __m256i p0 = _mm256_permute2x128_si256 (pa, pb, 0x20);
+	const __m256i p1 = _mm256_permute2x128_si256 (pa, pb, 0x31);
+	*r = _mm256_packs_epi32 (_mm256_and_si256 (_mm256_srli_epi32 (p0, 16), m), _mm256_and_si256 (_mm256_srli_epi32 (p1, 16), m));
+	*g = _mm256_packs_epi32 (_mm256_and_si256 (_mm256_srli_epi32 (p0,  8), m), _mm256_and_si256 (_mm256_srli_epi32 (p1,  8), m));
+	*b = _mm256_packs_epi32 (_mm256_and_si256 (p0, m), _mm256_and_si256 (p1, m));
+}
+
+YUV_AVX2 static inline __m256i avx2_dot3 (const __m256i r, const __m256i g, const __m256i b,
+		const __m256i krg, const __m256i kb, const __m256i off, const __m128i shift)
+{
+	const __m256i z = _mm256_setzero_si256 ();
+	__m256i lo = _mm256_add_epi32 (_mm256_madd_epi16 (_mm256_unpacklo_epi16 (r, g), krg), _mm256_madd_epi16 (_mm256_unpacklo_epi16 (b, z), kb));
+	__m256i hi = _mm256_add_epi32 (_mm256_madd_epi16 (_mm256_unpackhi_epi16 (r, g), krg), _mm256_madd_epi16 (_mm256_unpackhi_epi16 (b, z), kb));
+	lo = _mm256_sra_epi32 (_mm256_add_epi32 (lo, off), shift);
+	hi = _mm256_sra_epi32 (_mm256_add_epi32 (hi, off), shift);
+	return _mm256_packs_epi32 (lo, hi);
+}
+
+/* 16 x 16 bit -> 16 x 8 bit, saturated */
+YUV_AVX2 static inline __m128i avx2_pack8 (const __m256i x) {
+	return _mm256_castsi256_si128 (_mm256_permute4x64_epi64 (_mm256_packus_epi16 (x, x), 0x08));
+}
+
+YUV_AVX2 static int yuv_row_avx2 (const uint32_t *r0, const uint32_t *r1,
+		uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+		const int w, YuvFormat const *f)
+{
+	int x;
+	const __m256i yrg = _mm256_set1_epi32 (K_RG(f->ky));
+	const __m256i yb  = _mm256_set1_epi32 (K_B(f->ky));
+	const __m256i urg = _mm256_set1_epi32 (K_RG(f->ku));
+	const __m256i ub  = _mm256_set1_epi32 (K_B(f->ku));
+	const __m256i vrg = _mm256_set1_epi32 (K_RG(f->kv));
+	const __m256i vb  = _mm256_set1_epi32 (K_B(f->kv));
+	const __m256i yo  = _mm256_set1_epi32 (yuv_luma_offset (f));
+	const __m256i co  = _mm256_set1_epi32 (yuv_chroma_offset (f));
+	const __m128i ys  = _mm_cvtsi32_si128 (15);
+	const __m128i cs  = _mm_cvtsi32_si128 (yuv_chroma_shift (f));
+	const __m256i one = _mm256_set1_epi16 (1);
+	const __m256i uvi = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+
+	for (x = 0; x + 16 <= w; x += 16) {
+		__m256i ra, ga, ba; // row 0
+		__m256i rc, gc, bc; // row 1
+		avx2_load (r0 + x, &ra, &ga, &ba);
+		avx2_load (r1 + x, &rc, &gc, &bc);
+
+		_mm_storeu_si128 ((__m128i*) (y0 + x), avx2_pack8 (avx2_dot3 (ra, ga, ba, yrg, yb, yo, ys)));
+		if (y1) {
+			_mm_storeu_si128 ((__m128i*) (y1 + x), avx2_pack8 (avx2_dot3 (rc, gc, bc, yrg, yb, yo, ys)));
+		}
+
+		ra = _mm256_add_epi16 (ra, rc);
+		ga = _mm256_add_epi16 (ga, gc);
+		ba = _mm256_add_epi16 (ba, bc);
+
+		if (f->chroma == 444) {
+			_mm_storeu_si128 ((__m128i*) (u + x), avx2_pack8 (avx2_dot3 (ra, ga, ba, urg, ub, co, cs)));
+			_mm_storeu_si128 ((__m128i*) (v + x), avx2_pack8 (avx2_dot3 (ra, ga, ba, vrg, vb, co, cs)));
+		} else {
+			/* horizontal pair sum, 8 x 32 bit */
+			const __m256i r = _mm256_madd_epi16 (ra, one);
+			const __m256i g = _mm256_madd_epi16 (ga, one);
+			const __m256i b = _mm256_madd_epi16 (ba, one);
+			__m256i cu = _mm256_add_epi32 (_mm256_mullo_epi32 (r, _mm256_set1_epi32 (f->ku[0])),
+					_mm256_add_epi32 (_mm256_mullo_epi32 (g, _mm256_set1_epi32 (f->ku[1])),
+						_mm256_mullo_epi32 (b, _mm256_set1_epi32 (f->ku[2]))));
+			__m256i cv = _mm256_add_epi32 (_mm256_mullo_epi32 (r, _mm256_set1_epi32 (f->kv[0])),
+					_mm256_add_epi32 (_mm256_mullo_epi32 (g, _mm256_set1_epi32 (f->kv[1])),
+						_mm256_mullo_epi32 (b, _mm256_set1_epi32 (f->kv[2]))));
+			cu = _mm256_sra_epi32 (_mm256_add_epi32 (cu, co), cs);
+			cv = _mm256_sra_epi32 (_mm256_add_epi32 (cv, co), cs);
+			/* [u0-3 v0-3 | u4-7 v4-7] -> [u0-7 v0-7] */
+			const __m256i uv = _mm256_packs_epi32 (cu, cv);
+			const __m128i p = _mm256_castsi256_si128 (_mm256_permutevar8x32_epi32 (_mm256_packus_epi16 (uv, uv), uvi));
+			_mm_storel_epi64 ((__m128i*) (u + x / 2), p);
+			_mm_storel_epi64 ((__m128i*) (v + x / 2), _mm_srli_si128 (p, 8));
+		}
+	}
+	return x;
+}
+#endif
+
+static int yuv_row_none (const uint32_t *r0, const uint32_t *r1,
+		uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+		const int w, YuvFormat const *f)
+{
+	return 0;
+}
+
+static void yuv_init (YuvFormat *f) {
+	const double kr = f->matrix == 709 ? .2126 : .299;
+	const double kb = f->matrix == 709 ? .0722 : .114;
+	const double kg = 1. - kr - kb;
+	const double sy = (f->full ? 255. : 219.) / 255. * 32768.;
+	const double sc = (f->full ? 255. : 224.) / 255. * 32768.;
+
+	f->ky[0] = rint (sy * kr);
+	f->ky[1] = rint (sy * kg);
+	f->ky[2] = rint (sy * kb);
+	f->ku[0] = rint (sc * -kr / (2. * (1. - kb)));
+	f->ku[1] = rint (sc * -kg / (2. * (1. - kb)));
+	f->ku[2] = rint (sc * .5);
+	f->kv[0] = rint (sc * .5);
+	f->kv[1] = rint (sc * -kg / (2. * (1. - kr)));
+	f->kv[2] = rint (sc * -kb / (2. * (1. - kr)));
+
+	f->row = yuv_row_none;
+#ifdef YUV_SIMD
+	if (__builtin_cpu_supports ("avx2")) {
+		f->row = yuv_row_avx2;
+	} else if (__builtin_cpu_supports ("sse2")) {
+		f->row = yuv_row_sse2;
+	}
+#endif
+}
+
+static int yuv_parse (YuvFormat *f, const char *spec) {
+	char tmp[64];
+	char *tok, *save = NULL;
+	strncpy (tmp, spec, sizeof(tmp));
+	tmp[sizeof(tmp) - 1] = '\0';
+	for (tok = strtok_r (tmp, ",", &save); tok; tok = strtok_r (NULL, ",", &save)) {
+		if (!strcmp (tok, "420") || !strcmp (tok, "422") || !strcmp (tok, "444")) {
+			f->chroma = atoi (tok);
+		} else if (!strcmp (tok, "601") || !strcmp (tok, "bt601")) {
+			f->matrix = 601;
+		} else if (!strcmp (tok, "709") || !strcmp (tok, "bt709")) {
+			f->matrix = 709;
+		} else if (!strcmp (tok, "full") || !strcmp (tok, "pc")) {
+			f->full = 1;
+		} else if (!strcmp (tok, "limited") || !strcmp (tok, "tv")) {
+			f->full = 0;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static size_t yuv_frame_size (YuvFormat const *f, const int w, const int h) {
+	const size_t cw = f->chroma == 444 ? w : (w + 1) / 2;
+	const size_t ch = f->chroma == 420 ? (h + 1) / 2 : h;
+	return (size_t)w * h + 2 * cw * ch;
+}
+
+static void yuv_convert (cairo_surface_t *cs, YuvFormat const *f, uint8_t *yuv) {
+	int y;
+	const int w = cairo_image_surface_get_width (cs);
+	const int h = cairo_image_surface_get_height (cs);
+	const int s = cairo_image_surface_get_stride (cs);
+	const int cw = f->chroma == 444 ? w : (w + 1) / 2;
+	const int ch = f->chroma == 420 ? (h + 1) / 2 : h;
+	const int step = f->chroma == 420 ? 2 : 1;
+
+	cairo_surface_flush (cs);
+	const uint8_t *img_data = cairo_image_surface_get_data (cs);
+
+	uint8_t *py = yuv;
+	uint8_t *pu = yuv + w * h;
+	uint8_t *pv = pu + cw * ch;
+
+	for (y = 0; y < h; y += step) {
+		const uint32_t *r0 = (const uint32_t*) (img_data + y * s);
+		const uint32_t *r1 = r0;
+		uint8_t *y1 = NULL;
+		if (step == 2 && y + 1 < h) {
+			r1 = (const uint32_t*) (img_data + (y + 1) * s);
+			y1 = py + (y + 1) * w;
+		}
+		uint8_t *u = pu + (y / step) * cw;
+		uint8_t *v = pv + (y / step) * cw;
+		const int x = f->row (r0, r1, py + y * w, y1, u, v, w, f);
+		yuv_row_c (r0, r1, py + y * w, y1, u, v, x, w, f);
+	}
+}
+
+/*** YUV4MPEG2 stream writer
+ * raw planar video on a pipe, in order, no deflate and no scratch files.
+ */
+
+static int y4m_write_header (FILE *x, const int w, const int h, TimecodeRate const * const r, YuvFormat const *f) {
+	const char *cs;
+	switch (f->chroma) {
+		case 444: cs = "C444 XYSCSS=444"; break;
+		case 422: cs = "C422 XYSCSS=422"; break;
+		default:  cs = "C420jpeg XYSCSS=420JPEG"; break;
+	}
+	return fprintf (x, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 %s XCOLORRANGE=%s\n",
+			w, h, r->fps.num, r->fps.den, cs, f->full ? "FULL" : "LIMITED") < 0 ? -1 : 0;
+}
+
+static int y4m_write_frame (FILE *x, const uint8_t *yuv, const size_t len) {
+	if (fputs ("FRAME\n", x) < 0) return -1;
+	if (fwrite (yuv, 1, len, x) != len) return -1;
+	return 0;
+}
+
+/*** fast image formats
+ * Alternatives to PNG when the images are consumed right away, e.g. by an
+ * encoder on the same machine, and deflate is wasted work:
+ *  - QOI: lossless, a single pass over the image (qoiformat.org)
+ *  - PAM, PPM: uncompressed RGB, only the areas that changed are converted
+ *  - raw: the frame buffer as is, described by a .raw.json sidecar file
+ */
+enum {
+	IMG_PNG = 0,
+	IMG_QOI,
+	IMG_PAM,
+	IMG_PPM,
+	IMG_RAW,
+	IMG_LAST
+};
+
+static const char * const image_ext[IMG_LAST] = { "png", "qoi", "pam", "ppm", "raw" };
+
+static int image_format_parse (const char *name) {
+	int f;
+	for (f = 0; f < IMG_LAST; ++f) {
+		if (!strcmp (name, image_ext[f])) {
+			return f;
+		}
+	}
+	return -1;
+}
+
+/* encoded image, except PNG */
+typedef struct ImageData {
+	uint8_t head[96];
+	uint8_t *pix;      ///< QOI, PAM, PPM: encoded pixels
+	int converted;     ///< PAM, PPM: `pix` holds a complete frame
+	DirtyRegion prev;  ///< PAM, PPM: areas of the previous frame in `pix`
+	struct iovec iov[2];
+} ImageData;
+
+/* file header, return its size */
+static size_t image_head (uint8_t *d, const int format, const int w, const int h) {
+	switch (format) {
+		case IMG_QOI:
+			memcpy (d, "qoif", 4);
+			d[4] = w >> 24; d[5] = w >> 16; d[6] = w >> 8; d[7] = w;
+			d[8] = h >> 24; d[9] = h >> 16; d[10] = h >> 8; d[11] = h;
+			d[12] = 3; // RGB
+			d[13] = 0; // sRGB
+			return 14;
+		case IMG_PAM:
+			return sprintf ((char*)d, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n", w, h);
+		case IMG_PPM:
+			return sprintf ((char*)d, "P6\n%d %d\n255\n", w, h);
+		default:
+			return 0;
+	}
+}
+
+/* size of the encoded pixels, an upper bound for QOI */
+static size_t image_pix_size (const int format, const int w, const int h) {
+	switch (format) {
+		case IMG_QOI:
+			return (size_t)w * h * 4 + 8; // QOI_OP_RGB for every pixel, end marker
+		case IMG_PAM:
+		case IMG_PPM:
+			return (size_t)w * h * 3;
+		case IMG_RAW:
+			return (size_t)w * h * 4;
+		default:
+			return 0;
+	}
+}
+
+#ifdef CUSTOM_PNG_WRITER
+/* file size of the formats that do not compress, 0 otherwise */
+static size_t image_fixed_size (const int format, const int w, const int h) {
+	uint8_t head[96];
+	if (format == IMG_PNG || format == IMG_QOI) {
+		return 0;
+	}
+	return image_head (head, format, w, h) + image_pix_size (format, w, h);
+}
+#endif
+
+static void rgb_rect (const uint8_t *img, const int stride, uint8_t *d, const int w, Rect const *r) {
+	int x, y;
+	for (y = r->y; y < r->y + r->h; ++y) {
+		const uint32_t *row = (const uint32_t*) (img + y * stride);
+		uint8_t *p = d + ((size_t)y * w + r->x) * 3;
+		for (x = r->x; x < r->x + r->w; ++x) {
+			*p++ = CH_R(row[x]);
+			*p++ = CH_G(row[x]);
+			*p++ = CH_B(row[x]);
+		}
+	}
+}
+
+/* QOI operations of an opaque image, return their size incl. end marker */
+static size_t qoi_encode (const uint8_t *img, const int stride, const int w, const int h, uint8_t *d) {
+	uint32_t index[64];
+	uint32_t prev = 0xff000000;
+	uint8_t *p = d;
+	int run = 0;
+	int x, y;
+
+	memset (index, 0, sizeof (index));
+	for (y = 0; y < h; ++y) {
+		const uint32_t *row = (const uint32_t*) (img + y * stride);
+		for (x = 0; x < w; ++x) {
+			const uint32_t px = row[x] | 0xff000000;
+			if (px == prev) {
+				if (++run == 62) {
+					*p++ = 0xc0 | (run - 1); // QOI_OP_RUN
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				*p++ = 0xc0 | (run - 1);
+				run = 0;
+			}
+			const int r = CH_R(px), g = CH_G(px), b = CH_B(px);
+			const int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) & 63;
+			if (index[hash] == px) {
+				*p++ = hash; // QOI_OP_INDEX
+			} else {
+				index[hash] = px;
+				const int8_t vr = r - CH_R(prev);
+				const int8_t vg = g - CH_G(prev);
+				const int8_t vb = b - CH_B(prev);
+				const int8_t vg_r = vr - vg;
+				const int8_t vg_b = vb - vg;
+				if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+					*p++ = 0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2); // QOI_OP_DIFF
+				} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+					*p++ = 0x80 | (vg + 32); // QOI_OP_LUMA
+					*p++ = (vg_r + 8) << 4 | (vg_b + 8);
+				} else {
+					*p++ = 0xfe; // QOI_OP_RGB
+					*p++ = r;
+					*p++ = g;
+					*p++ = b;
+				}
+			}
+			prev = px;
+		}
+	}
+	if (run > 0) {
+		*p++ = 0xc0 | (run - 1);
+	}
+	memset (p, 0, 7);
+	p[7] = 1;
+	return p + 8 - d;
+}
+
+static void image_encode (ImageData *im, FrameFile *ff, const int format, cairo_surface_t *cs, DirtyRegion const *dirty) {
+	const int w = cairo_image_surface_get_width (cs);
+	const int h = cairo_image_surface_get_height (cs);
+	const int stride = cairo_image_surface_get_stride (cs);
+	const uint8_t *img = cairo_image_surface_get_data (cs);
+	size_t len;
+	int i;
+
+	cairo_surface_flush (cs);
+	im->iov[0].iov_base = im->head;
+	im->iov[0].iov_len  = image_head (im->head, format, w, h);
+	im->iov[1].iov_base = im->pix;
+
+	switch (format) {
+		case IMG_QOI:
+			len = qoi_encode (img, stride, w, h, im->pix);
+			break;
+		case IMG_PAM:
+		case IMG_PPM:
+			/* restore the previous frame's areas, draw the current ones */
+			if (!im->converted) {
+				const Rect all = { 0, 0, w, h };
+				rgb_rect (img, stride, im->pix, w, &all);
+				im->converted = 1;
+			} else {
+				for (i = 0; i < im->prev.n; ++i) {
+					rgb_rect (img, stride, im->pix, w, &im->prev.r[i]);
+				}
+			}
+			for (i = 0; i < dirty->n; ++i) {
+				Rect r = dirty->r[i];
+				/* clip, overlay areas may extend beyond the frame */
+				const int x1 = MIN(w, r.x + r.w);
+				const int y1 = MIN(h, r.y + r.h);
+				r.x = MAX(0, r.x);
+				r.y = MAX(0, r.y);
+				r.w = MAX(0, x1 - r.x);
+				r.h = MAX(0, y1 - r.y);
+				rgb_rect (img, stride, im->pix, w, &r);
+				im->prev.r[i] = r;
+			}
+			im->prev.n = dirty->n;
+			len = (size_t)w * h * 3;
+			break;
+		default:
+			/* raw: native-endian ARGB32, no copy */
+			im->iov[1].iov_base = (void*) img;
+			len = (size_t)stride * h;
+			break;
+	}
+	im->iov[1].iov_len = len;
+
+	ff->iov    = im->iov;
+	ff->iovcnt = 2;
+	ff->size   = im->iov[0].iov_len + len;
+	ff->crc    = 0;
+}
+
+/* cairo ARGB32 is native endian */
+static const char *raw_pixel_format (void) {
+	const uint32_t one = 1;
+	return *(const uint8_t*)&one == 1 ? "bgra" : "argb";
+}
+
+/* description of raw frames for the consumer (JSON) */
+static int write_raw_info (FILE *x, const int w, const int h, TimecodeRate const *r,
+		const int64_t fn_start, const int64_t fn_end, const int64_t first, const int64_t end, const char *prefix)
+{
+	fprintf (x, "{\n");
+	fprintf (x, "  \"version\": \"%s\",\n", VERSION);
+	fprintf (x, "  \"width\": %d,\n", w);
+	fprintf (x, "  \"height\": %d,\n", h);
+	fprintf (x, "  \"stride\": %d,\n", w * 4);
+	fprintf (x, "  \"pixel_format\": \"%s\",\n", raw_pixel_format ());
+	fprintf (x, "  \"frame_size\": %zu,\n", image_pix_size (IMG_RAW, w, h));
+	fprintf (x, "  \"fps\": \"%d/%d\",\n", r->fps.num, r->fps.den);
+	fprintf (x, "  \"start_frame\": %"PRId64",\n", fn_start);
+	fprintf (x, "  \"frames\": %"PRId64",\n", fn_end - fn_start);
+	fprintf (x, "  \"range\": [%"PRId64", %"PRId64"],\n", first, end);
+	fprintf (x, "  \"files\": \"");
+	json_escape (x, prefix);
+	fprintf (x, "%%08d.raw\"\n");
+	fprintf (x, "}\n");
+	return ferror (x) ? -1 : 0;
+}
+
+/*** POSIX tar stream writer
+ * Images in a single ustar archive, in order. The header is
+ * prepared once, per file only name, size and checksum are filled in.
+ */
+#define TAR_BLOCK 512
+
+typedef struct TarWriter {
+	uint8_t head[TAR_BLOCK];
+	unsigned int sum; ///< checksum of the header without name and size
+} TarWriter;
+
+static void tar_init (TarWriter *tw, const time_t mtime) {
+	int i;
+	uint8_t *h = tw->head;
+	memset (tw, 0, sizeof (TarWriter));
+	memcpy (h + 100, "0000644", 8); // mode
+	memcpy (h + 108, "0000000", 8); // uid
+	memcpy (h + 116, "0000000", 8); // gid
+	snprintf ((char*)h + 136, 12, "%011lo", (unsigned long)mtime);
+	memset (h + 148, ' ', 8);       // checksum
+	h[156] = '0';                   // regular file
+	memcpy (h + 257, "ustar", 6);
+	memcpy (h + 263, "00", 2);
+	for (i = 0; i < TAR_BLOCK; ++i) {
+		tw->sum += h[i];
+	}
+}
+
+static size_t tar_size (const size_t size) {
+	return TAR_BLOCK + ((size + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1));
+}
+
+static int tar_write_file (FILE *x, TarWriter const *tw, const char *name, FrameFile const *ff) {
+	static const uint8_t pad[TAR_BLOCK];
+	uint8_t h[TAR_BLOCK];
+	unsigned int sum = tw->sum;
+	int i;
+
+	memcpy (h, tw->head, TAR_BLOCK);
+	memcpy (h, name, MIN(strlen (name), 100));
+	snprintf ((char*)h + 124, 12, "%011lo", (unsigned long)ff->size);
+	for (i = 0; i < 100; ++i) {
+		sum += h[i];
+	}
+	for (i = 124; i < 136; ++i) {
+		sum += h[i];
+	}
+	snprintf ((char*)h + 148, 8, "%06o", sum);
+	h[155] = ' ';
+
+	if (fwrite (h, TAR_BLOCK, 1, x) != 1) {
+		return -1;
+	}
+	for (i = 0; i < ff->iovcnt; ++i) {
+		if (fwrite (ff->iov[i].iov_base, 1, ff->iov[i].iov_len, x) != ff->iov[i].iov_len) {
+			return -1;
+		}
+	}
+	const size_t p = tar_size (ff->size) - TAR_BLOCK - ff->size;
+	if (p > 0 && fwrite (pad, 1, p, x) != p) {
+		return -1;
+	}
+	return 0;
+}
+
+/* end of archive: two zero blocks */
+static int tar_write_end (FILE *x) {
+	static const uint8_t pad[2 * TAR_BLOCK];
+	return fwrite (pad, sizeof (pad), 1, x) == 1 ? 0 : -1;
+}
+
+/*** animated PNG writer
+ * All frames in a single APNG file, in order. The first frame is the
+ * default image (IDAT), every following frame only covers the area that
+ * differs from the previous frame (fcTL + fdAT), and replaces it.
+ */
+#ifdef CUSTOM_PNG_WRITER
+/* frame duration as 16 bit fraction of a second */
+static void apng_delay (TimecodeRate const *r, uint16_t *num, uint16_t *den) {
+	uint32_t a = r->fps.den;
+	uint32_t b = r->fps.num;
+	uint32_t x = a, y = b;
+	while (y > 0) {
+		const uint32_t t = x % y;
+		x = y;
+		y = t;
+	}
+	a /= x;
+	b /= x;
+	while (a > 0xffff || b > 0xffff) {
+		a = (a + 1) / 2;
+		b = (b + 1) / 2;
+	}
+	*num = a;
+	*den = b;
+}
+
+static size_t apng_actl (uint8_t *d, const int64_t n_frames) {
+	uint8_t actl[8];
+	png_save_uint_32 (actl, MIN(n_frames, PNG_UINT_31_MAX));
+	png_save_uint_32 (actl + 4, 0); // loop forever
+	return png_chunk (d, "acTL", actl, sizeof (actl));
+}
+
+/* signature, IHDR, acTL and bKGD.
+ * `actl` is set to the file position of the acTL chunk, -1 if the
+ * output is not seekable.
+ */
+static int apng_write_header (FILE *x, PngBands const *pb, const int64_t n_frames, off_t *actl) {
+	uint8_t head[PNG_HEAD_SIZE + 20];
+	size_t len;
+
+	len = png_header (head, pb, pb->w, pb->h);
+	*actl = ftello (x);
+	if (*actl >= 0) {
+		*actl += len;
+	}
+	len += apng_actl (head + len, n_frames);
+	len += png_bkgd (head + len);
+	return fwrite (head, len, 1, x) == 1 ? 0 : -1;
+}
+
+/* frame `k` of the animation, `pb` is the area of the frame that changed */
+static void apng_frame_prepare (PngFile *pf, PngBands const *pb, const int64_t k, TimecodeRate const *r) {
+	uint8_t fctl[26];
+	uint16_t num, den;
+
+	apng_delay (r, &num, &den);
+	png_save_uint_32 (fctl, k > 0 ? 2 * k - 1 : 0); // sequence number
+	png_save_uint_32 (fctl + 4, pb->w);
+	png_save_uint_32 (fctl + 8, pb->h);
+	png_save_uint_32 (fctl + 12, pb->x);
+	png_save_uint_32 (fctl + 16, pb->y);
+	png_save_uint_16 (fctl + 20, num);
+	png_save_uint_16 (fctl + 22, den);
+	fctl[24] = 0; // dispose: none
+	fctl[25] = 0; // blend: source
+
+	png_file_data (pf, pb, pf->head + png_chunk (pf->head, "fcTL", fctl, sizeof (fctl)), k > 0 ? 2 * k : -1, 0);
+}
+
+static int apng_write_frame (FILE *x, FrameFile const *ff) {
+	int i;
+	for (i = 0; i < ff->iovcnt; ++i) {
+		if (fwrite (ff->iov[i].iov_base, 1, ff->iov[i].iov_len, x) != ff->iov[i].iov_len) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* IEND, and if fewer than the announced frames were written (interrupted)
+ * and the output is seekable, correct num_frames in the acTL chunk */
+static int apng_write_end (FILE *x, const off_t actl, const int64_t n_frames, const int64_t written) {
+	uint8_t iend[12];
+	uint8_t chunk[20];
+	png_chunk (iend, "IEND", NULL, 0);
+	if (fwrite (iend, sizeof (iend), 1, x) != 1) {
+		return -1;
+	}
+	if (actl < 0 || written == n_frames) {
+		return 0;
+	}
+	apng_actl (chunk, written);
+	if (fseeko (x, actl, SEEK_SET) || fwrite (chunk, sizeof (chunk), 1, x) != 1 || fseeko (x, 0, SEEK_END)) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*** performance report */
+
+/* center of the bin in ns */
+static double perf_bin_value (const int bin) {
+	if (bin < PERF_SUB) {
+		return bin;
+	}
+	const int msb = bin / PERF_SUB + 3;
+	return ldexp (PERF_SUB + (bin % PERF_SUB) + .5, msb - 4);
+}
+
+static void perf_merge (PerfStats *dst, PerfStats const *src) {
+	int i, b;
+	for (i = 0; i < PERF_LAST; ++i) {
+		dst->c[i].n     += src->c[i].n;
+		dst->c[i].total += src->c[i].total;
+		dst->c[i].max    = MAX(dst->c[i].max, src->c[i].max);
+		for (b = 0; b < PERF_BINS; ++b) {
+			dst->c[i].hist[b] += src->c[i].hist[b];
+		}
+	}
+	dst->busy   += src->busy;
+	dst->frames += src->frames;
+	dst->bytes  += src->bytes;
+}
+
+/* percentile in ms */
+static double perf_percentile (PerfCounter const *pc, const double pct) {
+	int b;
+	uint64_t sum = 0;
+	const uint64_t want = ceil (pc->n * pct / 100.);
+	if (pc->n == 0) {
+		return 0;
+	}
+	for (b = 0; b < PERF_BINS; ++b) {
+		sum += pc->hist[b];
+		if (sum >= want && sum > 0) {
+			return MIN(perf_bin_value (b), pc->max) / 1e6;
+		}
+	}
+	return pc->max / 1e6;
+}
+
+/*** thread worker */
+
+/* copy the given areas of the background, only pixel aligned blits */
+/* the first `skip` areas are re-drawn for every frame anyway (motion) */
+/* without background (--overlay) the areas are cleared */
+static void restore_bg (cairo_t* cr, cairo_surface_t *bg, DirtyRegion const *d, const int skip) {
+	int i;
+	cairo_save (cr);
+	if (bg) {
+		cairo_set_source_surface (cr, bg, 0, 0);
+		cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	} else {
+		cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+	}
+	for (i = skip; i < d->n; ++i) {
+		cairo_rectangle (cr, d->r[i].x, d->r[i].y, d->r[i].w, d->r[i].h);
+	}
+	cairo_fill (cr);
+	cairo_restore (cr);
+}
+
+/* bounding box of all areas, within the frame. Empty areas yield a single pixel. */
+static void dirty_bounds (DirtyRegion const *d, const int w, const int h, Rect *b) {
+	int i;
+	int x0 = w, y0 = h, x1 = 0, y1 = 0;
+	for (i = 0; i < d->n; ++i) {
+		x0 = MIN(x0, d->r[i].x);
+		y0 = MIN(y0, d->r[i].y);
+		x1 = MAX(x1, d->r[i].x + d->r[i].w);
+		y1 = MAX(y1, d->r[i].y + d->r[i].h);
+	}
+	x0 = MAX(0, x0);
+	y0 = MAX(0, y0);
+	x1 = MIN(w, x1);
+	y1 = MIN(h, y1);
+	if (x1 <= x0 || y1 <= y0) {
+		x0 = y0 = 0;
+		x1 = y1 = 1;
+	}
+	b->x = x0;
+	b->y = y0;
+	b->w = x1 - x0;
+	b->h = y1 - y0;
+}
+
+/* A separate image costs a file, its headers and a deflate stream,
+ * about as much as a transparent area of this many pixels. */
+#define CLUSTER_MERGE_PX (64 * 64)
+
+/* for --overlay: areas that overlap or are close are merged, so that every
+ * pixel is in at most one image. return the number of areas in `c`,
+ * at least one (an empty frame yields a single pixel).
+ */
+static int dirty_clusters (DirtyRegion const *d, const int w, const int h, Rect *c) {
+	int i, j, n = 0;
+	for (i = 0; i < d->n; ++i) {
+		const int x0 = MAX(0, d->r[i].x);
+		const int y0 = MAX(0, d->r[i].y);
+		const int x1 = MIN(w, d->r[i].x + d->r[i].w);
+		const int y1 = MIN(h, d->r[i].y + d->r[i].h);
+		if (x1 > x0 && y1 > y0) {
+			c[n].x = x0;
+			c[n].y = y0;
+			c[n].w = x1 - x0;
+			c[n].h = y1 - y0;
+			++n;
+		}
+	}
+	if (n == 0) {
+		c[0].x = c[0].y = 0;
+		c[0].w = c[0].h = 1;
+		return 1;
+	}
+again:
+	for (i = 0; i < n; ++i) {
+		for (j = i + 1; j < n; ++j) {
+			Rect const *a = &c[i];
+			Rect const *b = &c[j];
+			const int x0 = MIN(a->x, b->x);
+			const int y0 = MIN(a->y, b->y);
+			const int x1 = MAX(a->x + a->w, b->x + b->w);
+			const int y1 = MAX(a->y + a->h, b->y + b->h);
+			const int overlap = a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+			if (overlap || (int64_t)(x1 - x0) * (y1 - y0) <= (int64_t)a->w * a->h + (int64_t)b->w * b->h + CLUSTER_MERGE_PX) {
+				c[i].x = x0;
+				c[i].y = y0;
+				c[i].w = x1 - x0;
+				c[i].h = y1 - y0;
+				c[j] = c[--n];
+				goto again;
+			}
+		}
+	}
+	return n;
+}
+
+static pthread_mutex_t  cnt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  thr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int64_t frame_cnt;
+static volatile int     run_cnt;
+
+/* SIGINT, SIGTERM: stop rendering, finish frames in flight.
+ * The handler is reset after the first signal, a second one terminates.
+ */
+static volatile sig_atomic_t interrupted = 0;
+
+static void catch_signal (int sig) {
+	interrupted = 1;
+}
+
+/* Frame scheduler.
+ * Workers claim chunks of consecutive frames from a shared cursor. Once all
+ * frames are handed out, idle workers steal the upper half of the remaining
+ * frames of another worker's chunk.
+ */
+typedef struct WorkRange {
+	pthread_mutex_t lock;
+	int64_t next;
+	int64_t end;
+} WorkRange;
+
+typedef struct Scheduler {
+	int64_t cursor;  ///< next frame to hand out, atomic
+	int64_t total;
+	int64_t chunk;
+	int n_workers;
+	WorkRange *range; ///< per worker
+} Scheduler;
+
+static int sched_init (Scheduler *s, const int64_t total, const int n_workers, const int64_t chunk) {
+	int i;
+	s->cursor = 0;
+	s->total = total;
+	s->chunk = MAX(1, chunk);
+	s->n_workers = n_workers;
+	s->range = calloc (n_workers, sizeof (WorkRange));
+	if (!s->range) {
+		return -1;
+	}
+	for (i = 0; i < n_workers; ++i) {
+		pthread_mutex_init (&s->range[i].lock, NULL);
+	}
+	return 0;
+}
+
+static void sched_free (Scheduler *s) {
+	int i;
+	for (i = 0; s->range && i < s->n_workers; ++i) {
+		pthread_mutex_destroy (&s->range[i].lock);
+	}
+	free (s->range);
+	s->range = NULL;
+}
+
+/* return the next frame for worker `id`, -1 when done */
+static int64_t sched_next (Scheduler *s, const int id) {
+	int i;
+	int64_t fn = -1;
+	WorkRange *own = &s->range[id];
+
+	pthread_mutex_lock (&own->lock);
+	if (own->next < own->end) {
+		fn = own->next++;
+	}
+	pthread_mutex_unlock (&own->lock);
+	if (fn >= 0) {
+		return fn;
+	}
+
+	/* claim a new chunk */
+	const int64_t start = __sync_fetch_and_add (&s->cursor, s->chunk);
+	if (start < s->total) {
+		pthread_mutex_lock (&own->lock);
+		own->next = start + 1;
+		own->end = MIN(s->total, start + s->chunk);
+		pthread_mutex_unlock (&own->lock);
+		return start;
+	}
+
+	/* steal from the worker with the most remaining frames */
+	for (;;) {
+		int victim = -1;
+		int64_t most = 0;
+		for (i = 0; i < s->n_workers; ++i) {
+			if (i == id) {
+				continue;
+			}
+			pthread_mutex_lock (&s->range[i].lock);
+			const int64_t left = s->range[i].end - s->range[i].next;
+			pthread_mutex_unlock (&s->range[i].lock);
+			if (left > most) {
+				most = left;
+				victim = i;
+			}
+		}
+		if (victim < 0) {
+			return -1;
+		}
+
+		WorkRange *v = &s->range[victim];
+		int64_t lo = 0, hi = 0;
+		pthread_mutex_lock (&v->lock);
+		if (v->next < v->end) {
+			lo = v->next + (v->end - v->next) / 2;
+			hi = v->end;
+			v->end = lo;
+		}
+		pthread_mutex_unlock (&v->lock);
+
+		if (lo < hi) {
+			pthread_mutex_lock (&own->lock);
+			own->next = lo + 1;
+			own->end = hi;
+			pthread_mutex_unlock (&own->lock);
+			return lo;
+		}
+	}
+}
+
+/* Bounded multi-producer/multi-consumer queue of frame buffers.
+ * The ring itself is lock-free (per-cell sequence numbers), counting
+ * semaphores are only used to block while the queue is empty or full.
+ */
+struct FrameBuf;
+
+typedef struct FrameCell {
+	size_t seq;
+	struct FrameBuf *fb;
+} FrameCell;
+
+typedef struct FrameQueue {
+	FrameCell *cell;
+	size_t mask;
+	size_t head;
+	size_t tail;
+	sem_t items;
+	sem_t slots;
+} FrameQueue;
+
+static int fq_init (FrameQueue *q, const size_t min_size) {
+	size_t i, n = 1;
+	while (n < min_size) {
+		n <<= 1;
+	}
+	memset (q, 0, sizeof (FrameQueue));
+	if (!(q->cell = calloc (n, sizeof (FrameCell)))) {
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		q->cell[i].seq = i;
+	}
+	q->mask = n - 1;
+	if (sem_init (&q->items, 0, 0)) {
+		free (q->cell);
+		q->cell = NULL;
+		return -1;
+	}
+	if (sem_init (&q->slots, 0, n)) {
+		sem_destroy (&q->items);
+		free (q->cell);
+		q->cell = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void fq_free (FrameQueue *q) {
+	if (!q->cell) {
+		return;
+	}
+	sem_destroy (&q->items);
+	sem_destroy (&q->slots);
+	free (q->cell);
+	q->cell = NULL;
+}
+
+static void fq_wait (sem_t *s) {
+	while (sem_wait (s)) {
+		if (errno != EINTR) {
+			fprintf (stderr, "Fatal error: Frame queue failed (%s).\n", strerror (errno));
+			exit (1);
+		}
+	}
+}
+
+static void fq_push (FrameQueue *q, struct FrameBuf *fb) {
+	fq_wait (&q->slots);
+	const size_t pos = __sync_fetch_and_add (&q->tail, 1);
+	FrameCell *c = &q->cell[pos & q->mask];
+	while (__atomic_load_n (&c->seq, __ATOMIC_ACQUIRE) != pos) {
+		sched_yield (); // previous consumer of this cell is not done yet
+	}
+	c->fb = fb;
+	__atomic_store_n (&c->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post (&q->items);
+}
+
+/* dequeue, after an item was reserved */
+static struct FrameBuf * fq_take (FrameQueue *q) {
+	const size_t pos = __sync_fetch_and_add (&q->head, 1);
+	FrameCell *c = &q->cell[pos & q->mask];
+	while (__atomic_load_n (&c->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+		sched_yield (); // producer of this cell is not done yet
+	}
+	struct FrameBuf *fb = c->fb;
+	__atomic_store_n (&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+	sem_post (&q->slots);
+	return fb;
+}
+
+static struct FrameBuf * fq_pop (FrameQueue *q) {
+	fq_wait (&q->items);
+	return fq_take (q);
+}
+
+#if defined CUSTOM_PNG_WRITER && defined HAVE_IO_URING
+/* non-blocking fq_pop, return 0 if an item was dequeued */
+static int fq_trypop (FrameQueue *q, struct FrameBuf **fb) {
+	if (sem_trywait (&q->items)) {
+		return -1;
+	}
+	*fb = fq_take (q);
+	return 0;
+}
+#endif
+
+#ifdef CUSTOM_PNG_WRITER
+/* --overlay: one image of a frame */
+typedef struct OverlayImage {
+	PngBands png;
+	PngFile file;
+	FrameFile out;
+} OverlayImage;
+#endif
+
+/* Frame buffer, recycled through the pipeline.
+ * Each buffer remembers the areas that were drawn on top of the background,
+ * so that only those need to be restored when it is re-used.
+ */
+typedef struct FrameBuf {
+	int64_t fn;         ///< frame number, relative to fn_start
+	uint8_t *data;      ///< pixel memory
+	cairo_surface_t *cs;
+	cairo_t *cr;
+	DirtyRegion dirty;
+	Rect bounds;        ///< --apng: area of the frame drawn on top of the background
+	int n_crop;         ///< --overlay: number of images, 0: a single full frame
+	Rect crop[DIRTY_MAX]; ///< --overlay: area of the frame in each image
+#ifdef CUSTOM_PNG_WRITER
+	PngBands png;       ///< compressed image
+	PngFile file;       ///< PNG file layout of `png`
+	OverlayImage *part; ///< --overlay: compressed images, one per `crop`
+#endif
+	ImageData img;      ///< --format other than PNG
+	FrameFile out;      ///< encoded file, `file` or `img`
+	uint8_t *yuv;       ///< converted image for streams
+} FrameBuf;
+
+/* number of image files of a frame */
+static int frame_images (FrameBuf const *fb) {
+	return fb->n_crop > 0 ? fb->n_crop : 1;
+}
+
+/* image `k` of a frame, and its part number for frame_path() */
+static FrameFile * frame_image (FrameBuf *fb, const int k, int *part) {
+#ifdef CUSTOM_PNG_WRITER
+	if (fb->n_crop > 0) {
+		*part = k;
+		return &fb->part[k].out;
+	}
+#endif
+	*part = -1;
+	return &fb->out;
+}
+
+/* buffers in the pool in addition to one per pipeline thread.
+ * More do not speed things up, but cost a frame of memory each. */
+#define FRAME_POOL_SLACK 4
+
+/* aligned memory, large buffers are backed by (transparent) huge pages */
+static void * frame_alloc (const size_t size) {
+	void *p = NULL;
+#ifdef MADV_HUGEPAGE
+	const size_t huge = 1 << 21;
+	if (size >= huge) {
+		if (posix_memalign (&p, huge, (size + huge - 1) & ~(huge - 1))) {
+			return NULL;
+		}
+		madvise (p, (size + huge - 1) & ~(huge - 1), MADV_HUGEPAGE);
+		return p;
+	}
+#endif
+	if (posix_memalign (&p, 64, size)) {
+		return NULL;
+	}
+	return p;
+}
+
+static void frame_buf_free (FrameBuf *fb) {
+	if (fb->cr) {
+		cairo_destroy (fb->cr);
+	}
+	if (fb->cs) {
+		cairo_surface_destroy (fb->cs);
+	}
+	free (fb->data);
+#ifdef CUSTOM_PNG_WRITER
+	png_bands_free (&fb->png);
+	png_file_free (&fb->file);
+	if (fb->part) {
+		int k;
+		for (k = 0; k < DIRTY_MAX; ++k) {
+			png_bands_free (&fb->part[k].png);
+			png_file_free (&fb->part[k].file);
+		}
+		free (fb->part);
+	}
+#endif
+	free (fb->img.pix);
+	free (fb->yuv);
+	memset (fb, 0, sizeof (FrameBuf));
+}
+
+/* without background (--overlay) the buffer is transparent, and images are RGBA */
+static int frame_buf_init (FrameBuf *fb, cairo_surface_t *bg, const int w, const int h, const int compression, const int format, const size_t yuv_size) {
+	const int stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32, w);
+	memset (fb, 0, sizeof (FrameBuf));
+
+	if (!(fb->data = frame_alloc ((size_t)stride * h))) {
+		return -1;
+	}
+	fb->cs = cairo_image_surface_create_for_data (fb->data, CAIRO_FORMAT_ARGB32, w, h, stride);
+	fb->cr = cairo_create (fb->cs);
+
+	if (bg) {
+		cairo_set_source_surface (fb->cr, bg, 0, 0);
+		cairo_set_operator (fb->cr, CAIRO_OPERATOR_SOURCE);
+	} else {
+		cairo_set_operator (fb->cr, CAIRO_OPERATOR_CLEAR);
+	}
+	cairo_paint (fb->cr);
+	cairo_set_operator (fb->cr, CAIRO_OPERATOR_OVER);
+
+	if (yuv_size > 0) {
+		if (!(fb->yuv = frame_alloc (yuv_size))) {
+			frame_buf_free (fb);
+			return -1;
+		}
+	} else if (format == IMG_QOI || format == IMG_PAM || format == IMG_PPM) {
+		if (!(fb->img.pix = frame_alloc (image_pix_size (format, w, h)))) {
+			frame_buf_free (fb);
+			return -1;
+		}
+	}
+#ifdef CUSTOM_PNG_WRITER
+	else if (format == IMG_PNG && !bg) {
+		int k;
+		if (!(fb->part = calloc (DIRTY_MAX, sizeof (OverlayImage)))) {
+			frame_buf_free (fb);
+			return -1;
+		}
+		for (k = 0; k < DIRTY_MAX; ++k) {
+			if (png_bands_init (&fb->part[k].png, w, h, compression, 4)
+					|| png_file_init (&fb->part[k].file, &fb->part[k].png)) {
+				frame_buf_free (fb);
+				return -1;
+			}
+		}
+	}
+	else if (format == IMG_PNG && (png_bands_init (&fb->png, w, h, compression, 3)
+				|| png_file_init (&fb->file, &fb->png))) {
+		frame_buf_free (fb);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* Dirty bounds of the most recent frames, for --apng: a frame is encoded
+ * relative to the previous one, which may still be drawn by another thread.
+ * Frames are handed out in order, and all frames in flight are within
+ * n_buf frames of each other (see write_stage), so 2 * n_buf slots suffice.
+ */
+typedef struct FrameBounds {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n;
+	int64_t *fn; ///< frame of each slot, -1: none
+	Rect *r;
+} FrameBounds;
+
+static int bounds_init (FrameBounds *b, const int n) {
+	int i;
+	memset (b, 0, sizeof (FrameBounds));
+	b->fn = malloc (n * sizeof (int64_t));
+	b->r = calloc (n, sizeof (Rect));
+	if (!b->fn || !b->r) {
+		free (b->fn);
+		free (b->r);
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		b->fn[i] = -1;
+	}
+	b->n = n;
+	pthread_mutex_init (&b->lock, NULL);
+	pthread_cond_init (&b->cond, NULL);
+	return 0;
+}
+
+static void bounds_free (FrameBounds *b) {
+	if (b->n == 0) {
+		return;
+	}
+	pthread_mutex_destroy (&b->lock);
+	pthread_cond_destroy (&b->cond);
+	free (b->fn);
+	free (b->r);
+	memset (b, 0, sizeof (FrameBounds));
+}
+
+static void bounds_put (FrameBounds *b, const int64_t fn, Rect const *r) {
+	pthread_mutex_lock (&b->lock);
+	b->fn[fn % b->n] = fn;
+	b->r[fn % b->n] = *r;
+	pthread_cond_broadcast (&b->cond);
+	pthread_mutex_unlock (&b->lock);
+}
+
+#ifdef CUSTOM_PNG_WRITER
+/* wait until frame `fn` is drawn */
+static void bounds_get (FrameBounds *b, const int64_t fn, Rect *r) {
+	pthread_mutex_lock (&b->lock);
+	while (b->fn[fn % b->n] != fn) {
+		pthread_cond_wait (&b->cond, &b->lock);
+	}
+	*r = b->r[fn % b->n];
+	pthread_mutex_unlock (&b->lock);
+}
+#endif
+
+/* Image files can be spread over sub-directories of the destination,
+ * either a fixed number of frames per directory, or by timecode.
+ */
+#define FANOUT_HOUR   (-1) ///< <hour>/
+#define FANOUT_MINUTE (-2) ///< <hour>/<minute>/
+
+/* directory of a frame relative to the destination, "" if flat */
+static int frame_dir (char *p, const int fanout, TimecodeRate *r, const int64_t fn_start, const int64_t fn) {
+	TimecodeTime tc;
+	if (fanout > 0) {
+		return sprintf (p, "%06"PRId64"/", fn / fanout);
+	}
+	if (fanout == 0) {
+		*p = '\0';
+		return 0;
+	}
+	framenumber_to_timecode (&tc, r, fn + fn_start);
+	if (fanout == FANOUT_MINUTE) {
+		return sprintf (p, "%02d/%02d/", tc.hour, tc.minute);
+	}
+	return sprintf (p, "%02d/", tc.hour);
+}
+
+/* frame filename relative to the destination.
+ * With --overlay a frame has several images, `part` is the image, -1 otherwise.
+ */
+static void frame_path (char *p, const int fanout, const char *prefix, const char *ext, TimecodeRate *r, const int64_t fn_start, const int64_t fn, const int part) {
+	p += frame_dir (p, fanout, r, fn_start, fn);
+	if (part >= 0) {
+		sprintf (p, "%s%08"PRId64"-%02d.%s", prefix, fn, part, ext);
+	} else {
+		sprintf (p, "%s%08"PRId64".%s", prefix, fn, ext);
+	}
+}
+
+/* create all sub-directories, before any frame is written */
+static int frame_mkdirs (const char *destdir, const int fanout, TimecodeRate *r, const int64_t fn_start, const int64_t first, const int64_t end) {
+	char dir[1024] = "";
+	char prev[1024] = "";
+	const int fps_i = ceil (r->fps.num / (double)r->fps.den);
+	int64_t step = fanout;
+	int64_t fn;
+	char *p;
+
+	for (fn = first; fanout != 0 && fn < end; fn += step) {
+		if (fanout < 0) {
+			/* continue with the next timecode minute. Drop-frame timecode
+			 * skips labels at the start of a minute, not frames, so the
+			 * remaining labels are the remaining frames of the minute. */
+			TimecodeTime tc;
+			framenumber_to_timecode (&tc, r, fn + fn_start);
+			step = (int64_t)fps_i * (60 - tc.second) - tc.frame;
+		}
+		const int len = sprintf (dir, "%s/", destdir);
+		frame_dir (dir + len, fanout, r, fn_start, fn);
+		if (!strcmp (dir, prev)) {
+			continue;
+		}
+		strcpy (prev, dir);
+		/* create parents first */
+		for (p = dir + len; (p = strchr (p, DIRSEP)); ++p) {
+			*p = '\0';
+			if (mkdir (dir, 0755) && errno != EEXIST) {
+				fprintf (stderr, "Error: Cannot create directory '%s'.\n", dir);
+				return -1;
+			}
+			*p = DIRSEP;
+		}
+	}
+	return 0;
+}
+
+/* Manifest of written files, one line per file, in frame order.
+ * Files complete out of order, the sizes are kept until all
+ * preceding frames are done. The manifest is flushed after every
+ * update, so that completed parts can be processed right away.
+ * Without a file, only the totals are collected (for --shard).
+ * The checkpoint has the same information for --resume, including
+ * the crc32 of every file. For --overlay a frame has several images,
+ * the manifest also lists the position and size of each in the frame.
+ */
+typedef struct Manifest {
+	FILE *x;        ///< NULL: no list of files
+	FILE *ckpt;     ///< NULL: no checkpoint
+	pthread_mutex_t lock;
+	uint8_t *done;  ///< 1: frame is written
+	uint8_t *n_img; ///< number of images per frame
+	int slots;      ///< images per frame at most
+	uint32_t *size; ///< file size per image
+	uint32_t *crc;  ///< crc32 per image
+	Rect *crop;     ///< --overlay: area of the frame per image, NULL: full frames
+	int64_t first;  ///< first frame of the range
+	int64_t next;   ///< first frame not in the manifest
+	int64_t end;
+	int64_t fn_start;
+	int fanout;
+	const char *prefix;
+	const char *ext;
+	TimecodeRate *rate;
+	uint64_t bytes; ///< total size of frames [first, next)
+	uint32_t total_crc; ///< crc32 of frames [first, next), concatenated
+	int error;
+} Manifest;
+
+static int manifest_open (Manifest *m, const char *filename, const int64_t first, const int64_t end, const int64_t fn_start, const int fanout, const char *prefix, const char *ext, TimecodeRate *rate, const int overlay) {
+	memset (m, 0, sizeof (Manifest));
+	m->slots = overlay ? DIRTY_MAX : 1;
+	m->done  = calloc (end - first, sizeof (uint8_t));
+	m->n_img = calloc (end - first, sizeof (uint8_t));
+	m->size  = calloc ((end - first) * m->slots, sizeof (uint32_t));
+	m->crc   = calloc ((end - first) * m->slots, sizeof (uint32_t));
+	if (overlay) {
+		m->crop = calloc ((end - first) * m->slots, sizeof (Rect));
+	}
+	if (!m->done || !m->n_img || !m->size || !m->crc || (overlay && !m->crop)
+			|| (filename && !(m->x = fopen (filename, "w")))) {
+		free (m->done);
+		free (m->n_img);
+		free (m->size);
+		free (m->crc);
+		free (m->crop);
+		return -1;
+	}
+	pthread_mutex_init (&m->lock, NULL);
+	m->first = m->next = first;
+	m->end = end;
+	m->fn_start = fn_start;
+	m->fanout = fanout;
+	m->prefix = prefix;
+	m->ext = ext;
+	m->rate = rate;
+	if (m->x) {
+		fprintf (m->x, "# frame timecode path size%s\n", overlay ? " x y width height" : "");
+	}
+	return 0;
+}
+
+#ifdef CUSTOM_PNG_WRITER
+/* record completed frames, the settings are the first line */
+static int manifest_checkpoint (Manifest *m, const char *filename, const char *settings) {
+	if (!(m->ckpt = fopen (filename, "w"))) {
+		return -1;
+	}
+	fprintf (m->ckpt, "%s\n", settings);
+	return fflush (m->ckpt) ? -1 : 0;
+}
+#endif
+
+static int manifest_close (Manifest *m) {
+	int rv = m->error;
+	if (!m->done) {
+		return 0;
+	}
+	if (m->x && fclose (m->x)) {
+		rv = -1;
+	}
+	if (m->ckpt && fclose (m->ckpt)) {
+		rv = -1;
+	}
+	m->ckpt = NULL;
+	pthread_mutex_destroy (&m->lock);
+	free (m->done);
+	free (m->n_img);
+	free (m->size);
+	free (m->crc);
+	free (m->crop);
+	m->x = NULL;
+	m->done = m->n_img = NULL;
+	m->size = m->crc = NULL;
+	m->crop = NULL;
+	return rv;
+}
+
+/* frame `fn` is complete, `n` files (more than one only for --overlay) */
+static void manifest_add (Manifest *m, const int64_t fn, const int n, const size_t *size, const uint32_t *crc, Rect const *crop) {
+	char path[1024];
+	char tcs[13] = "";
+	TimecodeTime tc;
+	int added = 0;
+	int k;
+
+	pthread_mutex_lock (&m->lock);
+	const size_t f = (fn - m->first) * m->slots;
+	for (k = 0; k < n; ++k) {
+		m->size[f + k] = size[k];
+		m->crc[f + k] = crc[k];
+		if (m->crop) {
+			m->crop[f + k] = crop[k];
+		}
+	}
+	m->n_img[fn - m->first] = n;
+	m->done[fn - m->first] = 1;
+	while (m->next < m->end && m->done[m->next - m->first]) {
+		const int64_t i = m->next++;
+		const size_t o = (i - m->first) * m->slots;
+		if (m->x) {
+			framenumber_to_timecode (&tc, m->rate, i + m->fn_start);
+			format_tc (tcs, m->rate, &tc);
+		}
+		for (k = 0; k < m->n_img[i - m->first]; ++k) {
+			const uint32_t sz = m->size[o + k];
+			m->bytes += sz;
+#ifdef CUSTOM_PNG_WRITER
+			m->total_crc = crc32_combine (m->total_crc, m->crc[o + k], sz);
+#endif
+			if (m->ckpt) {
+				if (fprintf (m->ckpt, "%"PRId64" %"PRIu32" %08"PRIx32"\n", i, sz, m->crc[o + k]) < 0) {
+					m->error = 1;
+				}
+				added = 1;
+			}
+			if (!m->x) {
+				continue;
+			}
+			frame_path (path, m->fanout, m->prefix, m->ext, m->rate, m->fn_start, i, m->crop ? k : -1);
+			if (fprintf (m->x, "%08"PRId64" %s %s %"PRIu32, i, tcs, path, sz) < 0) {
+				m->error = 1;
+			}
+			if (m->crop) {
+				Rect const *r = &m->crop[o + k];
+				if (fprintf (m->x, " %d %d %d %d", r->x, r->y, r->w, r->h) < 0) {
+					m->error = 1;
+				}
+			}
+			if (fputc ('\n', m->x) == EOF) {
+				m->error = 1;
+			}
+			added = 1;
+		}
+	}
+	if (added && ((m->x && fflush (m->x)) || (m->ckpt && fflush (m->ckpt)))) {
+		m->error = 1;
+	}
+	pthread_mutex_unlock (&m->lock);
+}
+
+#ifdef CUSTOM_PNG_WRITER
+/* check an image file written by a previous run: signature and trailer
+ * (PNG: IEND, QOI: end marker), uncompressed formats by size.
+ * return its size and crc32, 0 if it is not complete.
+ */
+static size_t image_file_check (const char *filename, const int format, const size_t fixed_size, uint32_t *crc) {
+	static const uint8_t png_sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	static const uint8_t png_end[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+	static const uint8_t qoi_end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	const uint8_t *sig = NULL;
+	const uint8_t *end = NULL;
+	size_t sig_len = 0;
+	size_t end_len = 0;
+	uint8_t buf[65536];
+	uint8_t tail[12];
+	size_t size = 0;
+	size_t n;
+	uLong c = crc32 (0, NULL, 0);
+
+	switch (format) {
+		case IMG_PNG:
+			sig = png_sig; sig_len = sizeof (png_sig);
+			end = png_end; end_len = sizeof (png_end);
+			break;
+		case IMG_QOI:
+			sig = (const uint8_t*)"qoif"; sig_len = 4;
+			end = qoi_end; end_len = sizeof (qoi_end);
+			break;
+		case IMG_PAM:
+			sig = (const uint8_t*)"P7\n"; sig_len = 3;
+			break;
+		case IMG_PPM:
+			sig = (const uint8_t*)"P6\n"; sig_len = 3;
+			break;
+		default:
+			break;
+	}
+
+	FILE *x = fopen (filename, "rb");
+	if (!x) {
+		return 0;
+	}
+	while ((n = fread (buf, 1, sizeof (buf), x)) > 0) {
+		if (size == 0 && sig && (n < sig_len || memcmp (buf, sig, sig_len))) {
+			break;
+		}
+		c = crc32 (c, buf, n);
+		/* keep the last 12 bytes */
+		if (n >= sizeof (tail)) {
+			memcpy (tail, buf + n - sizeof (tail), sizeof (tail));
+		} else {
+			memmove (tail, tail + n, sizeof (tail) - n);
+			memcpy (tail + sizeof (tail) - n, buf, n);
+		}
+		size += n;
+	}
+	const int err = ferror (x);
+	fclose (x);
+	if (err || n > 0 || size == 0 || size < sig_len + end_len || size > UINT32_MAX
+			|| (end && memcmp (tail + sizeof (tail) - end_len, end, end_len))
+			|| (fixed_size > 0 && size != fixed_size)) {
+		return 0;
+	}
+	*crc = c;
+	return size;
+}
+
+/* Find frames of [first, end) completed by a previous run with the same
+ * settings. Frames listed in the checkpoint are verified by size, any
+ * other existing file is read and checked completely.
+ * return the number of completed frames, -1 if the settings differ.
+ */
+static int64_t resume_scan (const char *ckptname, const char *settings, const char *destdir,
+		const int fanout, const char *prefix, const int format, const size_t fixed_size,
+		TimecodeRate *rate, const int64_t fn_start,
+		const int64_t first, const int64_t end, uint32_t *size, uint32_t *crc)
+{
+	char line[2048];
+	char filename[2048];
+	int64_t fn;
+	int64_t n_done = 0;
+	uint32_t sz, c;
+	struct stat st;
+
+	FILE *x = fopen (ckptname, "r");
+	if (!x) {
+		return 0; // nothing to resume
+	}
+	if (!fgets (line, sizeof (line), x) || strncmp (line, settings, strlen (settings)) || line[strlen (settings)] != '\n') {
+		fclose (x);
 		return -1;
 	}
+	while (fscanf (x, "%"SCNd64" %"SCNu32" %"SCNx32, &fn, &sz, &c) == 3) {
+		if (fn < first || fn >= end || sz == 0) {
+			continue;
+		}
+		const int len = sprintf (filename, "%s/", destdir);
+		frame_path (filename + len, fanout, prefix, image_ext[format], rate, fn_start, fn, -1);
+		if (!stat (filename, &st) && st.st_size == sz) {
+			size[fn - first] = sz;
+			crc[fn - first] = c;
+		}
+	}
+	fclose (x);
 
-	cairo_surface_flush (cs);
-	img_data = cairo_image_surface_get_data (cs);
+	for (fn = first; fn < end; ++fn) {
+		if (size[fn - first] > 0) {
+			++n_done;
+			continue;
+		}
+		const int len = sprintf (filename, "%s/", destdir);
+		frame_path (filename + len, fanout, prefix, image_ext[format], rate, fn_start, fn, -1);
+		if (access (filename, F_OK)) {
+			continue;
+		}
+		if ((size[fn - first] = image_file_check (filename, format, fixed_size, &crc[fn - first])) > 0) {
+			++n_done;
+		}
+	}
+	return n_done;
+}
+#endif
+
+/* Render -> encode -> write pipeline.
+ * Render threads draw the overlay into a free buffer, encode threads
+ * compress (or colorspace convert) it and write threads store the
+ * result. For streams (YUV4MPEG2 or tar) a single write thread releases
+ * frames in order.
+ */
+typedef struct workNfo {
+	float w;
+	float h;
+	Scheduler *sched;
+	int64_t fn_start;
+	int64_t fn_first;    ///< first frame to render, relative to fn_start
+	int64_t const *todo; ///< frames to render, NULL: all from fn_first
+	TimecodeRate *rate;
+	Tsmm2Context const *ctx; ///< background and overlay
+	const char * destdir;
+	const char * nameprefix;
+	int fanout;          ///< sub-directories, see frame_dir()
+	Manifest *manifest;  ///< NULL: no manifest
+	int compression;
+	int format;          ///< image file format, IMG_PNG, IMG_QOI, ...
+#ifdef CUSTOM_PNG_WRITER
+	PngBands const *bgpng; ///< compressed background
+	int deflate_lanes;
+	int uring;           ///< write PNG files using io_uring
+	int prealloc;        ///< fallocate PNG files
+	int checksum;        ///< crc32 of QOI/PAM/PPM/raw images, for --shard and --resume
+#endif
+	FILE *stream; ///< YUV4MPEG2 or tar output, NULL: write image files
+	TarWriter const *tar; ///< write images to `stream` as tar archive
+	int y4m;      ///< `stream` is YUV4MPEG2
+	YuvFormat const *yuvfmt;
+	int overlay;  ///< write only the overlay, cropped, as RGBA PNG
+	int apng;     ///< `stream` is an animated PNG
+	FrameBounds bounds; ///< --apng: areas of the previous frames
+
+	FrameBuf *buf;
+	int n_buf;
+	FrameQueue free_q;   ///< unused buffers
+	FrameQueue encode_q; ///< rendered frames
+	FrameQueue write_q;  ///< encoded frames
+	int n_render;
+	int n_encode;
+	int n_write;
+	int render_run;      ///< active render threads
+	int encode_run;      ///< active encode threads
+	int trace;           ///< record trace events
+	volatile int error;
+} workNfo;
 
-	png_byte ** rows = NULL;
-	png_struct *png;
-	png_info *info;
+typedef struct StageThread {
+	int id;
+	workNfo *nfo;
+	PerfStats perf;
+	TraceBuf trace;
+} StageThread;
 
-	rows = malloc (h * sizeof (png_byte*));
-	if (!rows) {
-		return -1;
+static void stage_exit (void) {
+	pthread_mutex_lock (&thr_mutex);
+	--run_cnt;
+	pthread_mutex_unlock (&thr_mutex);
+}
+
+static void count_frame (void) {
+	pthread_mutex_lock (&cnt_mutex);
+	++frame_cnt;
+	pthread_mutex_unlock (&cnt_mutex);
+}
+
+static void * render_stage (void *arg) {
+	StageThread *t = (StageThread*) arg;
+	workNfo *n = t->nfo;
+	PerfStats *ps = &t->perf;
+	int k;
+
+	trace_buf = n->trace ? &t->trace : NULL;
+	/* kept by the worker for all variants, see worker_run () */
+	if (!text_ctx) {
+		text_ctx = text_context_new ();
 	}
 
-	for (i = 0; i < h; ++i)
-		rows[i] = (png_byte *) img_data + i * s;
+	for (;;) {
+		const uint64_t tw = trace_begin ();
+		FrameBuf *fb = fq_pop (&n->free_q);
+		trace_end ("wait for buffer", tw);
+		int64_t i = (n->error || interrupted) ? -1 : sched_next (n->sched, t->id);
+		if (i < 0) {
+			fq_push (&n->free_q, fb);
+			break;
+		}
+		i = n->todo ? n->todo[i] : i + n->fn_first;
+
+		const uint64_t t0 = perf_now ();
+		uint64_t t1;
+
+		fb->fn = i;
+		restore_bg (fb->cr, n->overlay ? NULL : n->ctx->bg, &fb->dirty, n->ctx->motion.n);
+		fb->dirty.n = 0;
+		t1 = perf_add (ps, PERF_RESTORE, t0);
 
+		if (frame_draw (n->ctx, fb->cr, fb->cs, i, &fb->dirty, ps, &t1)) {
+			fprintf (stderr, "Rendering motion of frame %"PRId64" failed\n", i);
+			n->error = 1;
+		}
+		if (n->overlay) {
+			fb->n_crop = dirty_clusters (&fb->dirty, n->w, n->h, fb->crop);
+		}
+		if (n->apng) {
+			dirty_bounds (&fb->dirty, n->w, n->h, &fb->bounds);
+			bounds_put (&n->bounds, i, &fb->bounds);
+		}
+
+		ps->busy += t1 - t0;
+		++ps->frames;
 
-	png = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png) {
-		rv = 1;
-		goto BAIL1;
+		fq_push (&n->encode_q, fb);
 	}
-	info = png_create_info_struct (png);
-	if (!info) {
-		rv = 1;
-		goto BAIL2;
+
+	if (__sync_sub_and_fetch (&n->render_run, 1) == 0) {
+		for (k = 0; k < n->n_encode; ++k) {
+			fq_push (&n->encode_q, NULL);
+		}
 	}
+	stage_exit ();
+	return NULL;
+}
 
-	if (setjmp (png_jmpbuf (png))) {
-		rv = 1;
-		goto BAIL2;
+static void * encode_stage (void *arg) {
+	StageThread *t = (StageThread*) arg;
+	workNfo *n = t->nfo;
+	PerfStats *ps = &t->perf;
+	FrameBuf *fb;
+	int k;
+
+	trace_buf = n->trace ? &t->trace : NULL;
+
+#ifdef CUSTOM_PNG_WRITER
+	PngEncoder pe;
+	memset (&pe, 0, sizeof (PngEncoder));
+	if (!n->y4m && n->format == IMG_PNG && png_encoder_init (&pe, n->w, n->h, n->compression, n->overlay ? 4 : 3, n->deflate_lanes)) {
+		fprintf (stderr, "Cannot initialize PNG encoder\n");
+		n->error = 1;
 	}
+#endif
 
-	if (!(x = fopen (filename, "wb"))) {
-		rv = 1;
-		goto BAIL2;
+	for (;;) {
+		const uint64_t tw = trace_begin ();
+		fb = fq_pop (&n->encode_q);
+		trace_end ("wait for frame", tw);
+		if (!fb) {
+			break;
+		}
+		const uint64_t t0 = perf_now ();
+		if (n->error) {
+			;
+		} else if (n->y4m) {
+			yuv_convert (fb->cs, n->yuvfmt, fb->yuv);
+		} else if (n->format != IMG_PNG) {
+			image_encode (&fb->img, &fb->out, n->format, fb->cs, &fb->dirty);
+#ifdef CUSTOM_PNG_WRITER
+			if (n->checksum) {
+				int i;
+				uLong crc = crc32 (0, NULL, 0);
+				for (i = 0; i < fb->out.iovcnt; ++i) {
+					crc = crc32 (crc, fb->out.iov[i].iov_base, fb->out.iov[i].iov_len);
+				}
+				fb->out.crc = crc;
+			}
+#endif
+		}
+#ifdef CUSTOM_PNG_WRITER
+		else if (n->overlay) {
+			/* every crop differs from the (transparent) background as a whole */
+			for (k = 0; k < fb->n_crop; ++k) {
+				OverlayImage *oi = &fb->part[k];
+				png_bands_crop (&oi->png, &fb->crop[k]);
+				if (png_bands_encode (&pe, &oi->png, fb->cs, NULL, NULL)) {
+					fprintf (stderr, "Compressing frame %"PRId64" failed\n", fb->fn);
+					n->error = 1;
+					break;
+				}
+				png_file_prepare (&oi->file, &oi->png);
+				frame_file_png (&oi->out, &oi->file);
+			}
+		}
+		else if (n->apng) {
+			/* the first frame is complete, the others replace the
+			 * area that differs from the previous frame */
+			Rect r = { 0, 0, n->w, n->h };
+			PngBands const *ref = n->bgpng;
+			if (fb->fn > n->fn_first) {
+				Rect prev;
+				const uint64_t tp = trace_begin ();
+				bounds_get (&n->bounds, fb->fn - 1, &prev);
+				trace_end ("wait for previous frame", tp);
+				r.x = MIN(fb->bounds.x, prev.x);
+				r.y = MIN(fb->bounds.y, prev.y);
+				r.w = MAX(fb->bounds.x + fb->bounds.w, prev.x + prev.w) - r.x;
+				r.h = MAX(fb->bounds.y + fb->bounds.h, prev.y + prev.h) - r.y;
+				ref = NULL;
+			}
+			png_bands_crop (&fb->png, &r);
+			if (png_bands_encode (&pe, &fb->png, fb->cs, ref, &fb->dirty)) {
+				fprintf (stderr, "Compressing frame %"PRId64" failed\n", fb->fn);
+				n->error = 1;
+			} else {
+				apng_frame_prepare (&fb->file, &fb->png, fb->fn - n->fn_first, n->rate);
+				frame_file_png (&fb->out, &fb->file);
+			}
+		}
+		else if (png_bands_encode (&pe, &fb->png, fb->cs, n->bgpng, &fb->dirty)) {
+			fprintf (stderr, "Compressing frame %"PRId64" failed\n", fb->fn);
+			n->error = 1;
+		} else {
+			png_file_prepare (&fb->file, &fb->png);
+			frame_file_png (&fb->out, &fb->file);
+		}
+#endif
+		ps->busy += perf_add (ps, PERF_ENCODE, t0) - t0;
+		++ps->frames;
+		fq_push (&n->write_q, fb);
 	}
 
-	png_init_io (png, x);
+#ifdef CUSTOM_PNG_WRITER
+	png_encoder_free (&pe);
+#endif
 
-	if (compression >= 0 && compression <= 9)
-		png_set_compression_level (png, compression);
+	if (__sync_sub_and_fetch (&n->encode_run, 1) == 0) {
+		for (k = 0; k < n->n_write; ++k) {
+			fq_push (&n->write_q, NULL);
+		}
+	}
+	stage_exit ();
+	return NULL;
+}
 
-	png_set_IHDR (png, info, w, h, 8, PNG_COLOR_TYPE_RGB,
-			PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_DEFAULT,
-			PNG_FILTER_TYPE_DEFAULT);
+static void * write_stage (void *arg) {
+	StageThread *t = (StageThread*) arg;
+	workNfo *n = t->nfo;
+	PerfStats *ps = &t->perf;
+	const size_t yuv_size = yuv_frame_size (n->yuvfmt, n->w, n->h);
+	char filename[1024] = "";
+	FrameBuf **pending = NULL;
+	int64_t next = n->fn_first;
+	FrameBuf *fb;
 
+	trace_buf = n->trace ? &t->trace : NULL;
 
-	// explicit white balance
-	png_color_16 white;
-	white.gray = (1 << 8) - 1;
-	white.red = white.blue = white.green = white.gray;
-	png_set_bKGD (png, info, &white);
+	/* frames on a stream are written in order,
+	 * all frames in flight are in [next, next + n_buf) */
+	if (n->stream && !(pending = calloc (n->n_buf, sizeof (FrameBuf*)))) {
+		fprintf (stderr, "Out of memory\n");
+		n->error = 1;
+	}
 
-	png_write_info (png, info);
-#if 0
-	png_set_write_user_transform_fn (png, convert_to_rgb);
+	for (;;) {
+		const uint64_t tw = trace_begin ();
+		fb = fq_pop (&n->write_q);
+		trace_end ("wait for frame", tw);
+		if (!fb) {
+			break;
+		}
+		if (!n->stream) {
+			if (!n->error) {
+				const uint64_t t0 = perf_now ();
+				const int len = sprintf (filename, "%s/", n->destdir);
+				const int n_img = frame_images (fb);
+				size_t size[DIRTY_MAX];
+				uint32_t crc[DIRTY_MAX];
+				int k, part, rv = 0;
+				for (k = 0; k < n_img && !rv; ++k) {
+					FrameFile *ff = frame_image (fb, k, &part);
+					frame_path (filename + len, n->fanout, n->nameprefix, image_ext[n->format], n->rate, n->fn_start, fb->fn, part);
+					size[k] = ff->size;
+					crc[k] = ff->crc;
+#ifdef CUSTOM_PNG_WRITER
+					rv = write_file (ff, filename, n->prealloc);
 #else
-	png_set_bgr(png);
+					if (n->format == IMG_PNG) {
+						/* cairo does not tell the size of the file */
+						struct stat st;
+						rv = cairo_surface_write_to_png (fb->cs, filename) || stat (filename, &st);
+						size[k] = rv ? 0 : st.st_size;
+					} else {
+						rv = write_file (ff, filename, 0);
+					}
 #endif
-	png_set_filler (png, 0xff, PNG_FILLER_AFTER);
-	png_write_image (png, rows);
-	png_write_end (png, info);
+				}
+				if (rv) {
+					fprintf (stderr, "Writing to '%s' failed\n", filename);
+					n->error = 1;
+				} else {
+					count_frame ();
+					for (k = 0; k < n_img; ++k) {
+						ps->bytes += size[k];
+					}
+					if (n->manifest) {
+						manifest_add (n->manifest, fb->fn, n_img, size, crc, fb->crop);
+					}
+				}
+				ps->busy += perf_add (ps, PERF_WRITE, t0) - t0;
+				++ps->frames;
+			}
+			fq_push (&n->free_q, fb);
+			continue;
+		}
 
-	fclose (x);
-BAIL2:
-	png_destroy_write_struct (&png, &info);
-BAIL1:
-	free (rows);
-	return rv;
-}
+		if (!pending) {
+			fq_push (&n->free_q, fb);
+			continue;
+		}
+
+		pending[fb->fn % n->n_buf] = fb;
+		while ((fb = pending[next % n->n_buf]) && fb->fn == next) {
+			pending[next % n->n_buf] = NULL;
+			if (!n->error) {
+				const uint64_t t0 = perf_now ();
+				size_t len = 0;   ///< bytes written
+				size_t size[DIRTY_MAX]; ///< size of the frame or images
+				uint32_t crc[DIRTY_MAX];
+				int n_img = 1;
+				int rv = -1;
+				crc[0] = 0;
+				if (n->y4m) {
+					rv = y4m_write_frame (n->stream, fb->yuv, yuv_size);
+					len = size[0] = yuv_size + 6;
+				}
+#ifdef CUSTOM_PNG_WRITER
+				else if (n->apng) {
+					rv = apng_write_frame (n->stream, &fb->out);
+					len = size[0] = fb->out.size;
+					crc[0] = fb->out.crc;
+				}
 #endif
+				else {
+					int k, part;
+					n_img = frame_images (fb);
+					for (k = 0, rv = 0; k < n_img && !rv; ++k) {
+						FrameFile *ff = frame_image (fb, k, &part);
+						frame_path (filename, 0, n->nameprefix, image_ext[n->format], n->rate, n->fn_start, fb->fn, part);
+						rv = tar_write_file (n->stream, n->tar, filename, ff);
+						len += tar_size (ff->size);
+						size[k] = ff->size;
+						crc[k] = ff->crc;
+					}
+				}
+				if (rv) {
+					fprintf (stderr, "Writing frame %"PRId64" to stream failed\n", next);
+					n->error = 1;
+				} else {
+					count_frame ();
+					ps->bytes += len;
+					if (n->manifest) {
+						manifest_add (n->manifest, fb->fn, n_img, size, crc, fb->crop);
+					}
+				}
+				ps->busy += perf_add (ps, PERF_WRITE, t0) - t0;
+				++ps->frames;
+			}
+			++next;
+			fq_push (&n->free_q, fb);
+		}
+	}
 
-/*** thread worker */
+	free (pending);
+	stage_exit ();
+	return NULL;
+}
 
-static pthread_mutex_t  cnt_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t  thr_mutex = PTHREAD_MUTEX_INITIALIZER;
-static volatile int64_t frame_cnt;
-static volatile int     run_cnt;
+#if defined CUSTOM_PNG_WRITER && defined HAVE_IO_URING
+/* A single write thread submits image files in batches: first all files
+ * of a batch are opened, then (optionally preallocated and) written,
+ * and finally closed. Each step is one system call for the whole batch.
+ */
+#define URING_BATCH 32
+
+typedef struct UringFile {
+	FrameBuf *fb;
+	FrameFile *out;  ///< image of `fb`, frames can have several (--overlay)
+	int fd;
+	int error;
+	char filename[1024];
+} UringFile;
+
+static int uring_available (void) {
+	struct io_uring ring;
+	struct io_uring_probe *probe;
+	int ok;
+	if (io_uring_queue_init (4, &ring, 0)) {
+		return 0;
+	}
+	if (!(probe = io_uring_get_probe_ring (&ring))) {
+		io_uring_queue_exit (&ring);
+		return 0;
+	}
+	ok = io_uring_opcode_supported (probe, IORING_OP_OPENAT)
+		&& io_uring_opcode_supported (probe, IORING_OP_WRITEV)
+		&& io_uring_opcode_supported (probe, IORING_OP_FALLOCATE)
+		&& io_uring_opcode_supported (probe, IORING_OP_CLOSE);
+	io_uring_free_probe (probe);
+	io_uring_queue_exit (&ring);
+	return ok;
+}
 
-typedef struct workNfo {
-	pthread_t self;
-	float w;
-	float h;
-	int64_t wk_start;
-	int64_t wk_end;
-	int64_t fn_start;
-	int64_t fn_end;
-	TimecodeRate *rate;
-	cairo_surface_t *bg;
-	const char * title_text;
-	const char * destdir;
-	const char * nameprefix;
-	int compression;
-} workNfo;
+#define URING_PENDING INT_MIN ///< result of a request that did not complete
 
-static void * worker (void *arg) {
-	workNfo const * const n = (workNfo const * const) arg;
-	int64_t i = 0;
-	char filename[1024] = "";
-	cairo_surface_t * ct;
-	cairo_t* cr;
-
-	//localize variables
-	const float w = n->w;
-	const float h = n->h;
-	const int64_t fn_start = n->fn_start;
-	const int64_t wk_start = n->wk_start;
-	const int64_t wk_end   = n->wk_end;
-	const int compression = n->compression;
-
-	ct = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, w, h);
-	cr = cairo_create (ct);
-
-	for (i = wk_start; i < wk_end; ++i) {
-		cairo_set_source_surface (cr, n->bg, 0, 0);
-		cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-		cairo_paint (cr);
-		cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
-		timecode (cr, w, h, n->rate, i + fn_start);
+/* submit all `cnt` queued requests, and collect their results, indexed
+ * by user-data. On failure, the results of all requests that were
+ * submitted are still collected, the others remain URING_PENDING.
+ */
+static int uring_run (struct io_uring *ring, int *res, const int cnt) {
+	int submitted = 0;
+	int i;
+	while (submitted < cnt) {
+		const int rv = io_uring_submit (ring);
+		if (rv == -EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			break;
+		}
+		submitted += rv;
+	}
+	for (i = 0; i < submitted; ++i) {
+		struct io_uring_cqe *cqe;
+		int rv;
+		while ((rv = io_uring_wait_cqe (ring, &cqe)) == -EINTR) ;
+		if (rv) {
+			return -1;
+		}
+		res[(uintptr_t)io_uring_cqe_get_data (cqe)] = cqe->res;
+		io_uring_cqe_seen (ring, cqe);
+	}
+	return submitted == cnt ? 0 : -1;
+}
 
-		if (i == 0 && wk_start == 0) {
-			splash (cr, w, h, n->rate, n->fn_start, n->fn_end, n->title_text);
+static void uring_write_batch (struct io_uring *ring, UringFile *f, const int n_files, const int prealloc) {
+	int res[2 * URING_BATCH];
+	struct io_uring_sqe *sqe;
+	int i, cnt;
+
+	/* open, files that were opened are closed below, even if others failed */
+	for (i = 0; i < n_files; ++i) {
+		sqe = io_uring_get_sqe (ring);
+		io_uring_prep_openat (sqe, AT_FDCWD, f[i].filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		io_uring_sqe_set_data (sqe, (void*)(uintptr_t)(2 * i));
+		res[2 * i] = URING_PENDING;
+	}
+	uring_run (ring, res, n_files);
+	for (i = 0; i < n_files; ++i) {
+		f[i].fd = res[2 * i] >= 0 ? res[2 * i] : -1;
+		f[i].error = f[i].fd < 0;
+	}
+
+	/* write, large files are written synchronously */
+	for (i = 0, cnt = 0; i < n_files; ++i) {
+		FrameFile *ff = f[i].out;
+		if (f[i].error) {
+			continue;
+		}
+		if (ff->iovcnt > IOV_MAX) {
+			if (prealloc) {
+				fallocate (f[i].fd, 0, 0, ff->size);
+			}
+			f[i].error = pwritev_all (f[i].fd, ff->iov, ff->iovcnt, 0);
+			continue;
 		}
+		res[2 * i] = 0;
+		res[2 * i + 1] = URING_PENDING;
+		if (prealloc) {
+			/* hard-link: write even if preallocation is not supported */
+			sqe = io_uring_get_sqe (ring);
+			io_uring_prep_fallocate (sqe, f[i].fd, 0, 0, ff->size);
+			io_uring_sqe_set_data (sqe, (void*)(uintptr_t)(2 * i));
+			sqe->flags |= IOSQE_IO_HARDLINK;
+			++cnt;
+		}
+		sqe = io_uring_get_sqe (ring);
+		io_uring_prep_writev (sqe, f[i].fd, ff->iov, ff->iovcnt, 0);
+		io_uring_sqe_set_data (sqe, (void*)(uintptr_t)(2 * i + 1));
+		++cnt;
+	}
+	uring_run (ring, res, cnt);
+	for (i = 0; i < n_files; ++i) {
+		FrameFile *ff = f[i].out;
+		if (f[i].error || ff->iovcnt > IOV_MAX) {
+			continue;
+		}
+		const int written = res[2 * i + 1];
+		if (written < 0) { // includes URING_PENDING
+			f[i].error = 1;
+		} else if ((size_t)written < ff->size) {
+			f[i].error = pwritev_all (f[i].fd, ff->iov, ff->iovcnt, written);
+		}
+	}
 
-		sprintf (filename, "%s/%s%08"PRId64".png", n->destdir, n->nameprefix, i);
-#ifdef CUSTOM_PNG_WRITER
-		if (write_png (ct, filename, compression))
-#else
-		if (cairo_surface_write_to_png (ct, filename))
+	/* close */
+	for (i = 0, cnt = 0; i < n_files; ++i) {
+		if (f[i].fd < 0) {
+			continue;
+		}
+		sqe = io_uring_get_sqe (ring);
+		io_uring_prep_close (sqe, f[i].fd);
+		io_uring_sqe_set_data (sqe, (void*)(uintptr_t)(2 * i));
+		res[2 * i] = URING_PENDING;
+		++cnt;
+	}
+	uring_run (ring, res, cnt);
+	for (i = 0; i < n_files; ++i) {
+		if (f[i].fd < 0) {
+			continue;
+		}
+		if (res[2 * i] == URING_PENDING) {
+			/* the close request never ran */
+			res[2 * i] = close (f[i].fd);
+		}
+		if (res[2 * i] < 0) {
+			f[i].error = 1;
+		}
+	}
+}
+
+static void * uring_write_stage (void *arg) {
+	StageThread *t = (StageThread*) arg;
+	workNfo *n = t->nfo;
+	PerfStats *ps = &t->perf;
+	struct io_uring ring;
+	UringFile f[URING_BATCH];
+	int ring_ok = 1;
+	int done = 0;
+	int i;
+
+	trace_buf = n->trace ? &t->trace : NULL;
+
+	if (io_uring_queue_init (2 * URING_BATCH, &ring, 0)) {
+		fprintf (stderr, "Cannot initialize io_uring\n");
+		n->error = 1;
+		ring_ok = 0;
+	}
+
+	while (!done) {
+		int n_files = 0;
+		int n_frames = 0;
+		FrameBuf *fb;
+
+		/* wait for one frame, then collect all that are ready */
+		const uint64_t tw = trace_begin ();
+		fb = fq_pop (&n->write_q);
+		trace_end ("wait for frame", tw);
+		for (;;) {
+			if (!fb) {
+				done = 1;
+				break;
+			}
+			if (n->error) {
+				fq_push (&n->free_q, fb);
+			} else {
+				/* all images of a frame are in the same batch */
+				const int n_img = frame_images (fb);
+				int k, part;
+				for (k = 0; k < n_img; ++k, ++n_files) {
+					f[n_files].fb = fb;
+					f[n_files].out = frame_image (fb, k, &part);
+					f[n_files].fd = -1;
+					const int len = sprintf (f[n_files].filename, "%s/", n->destdir);
+					frame_path (f[n_files].filename + len, n->fanout, n->nameprefix, image_ext[n->format], n->rate, n->fn_start, fb->fn, part);
+				}
+				++n_frames;
+			}
+			if (n_files + (n->overlay ? DIRTY_MAX : 1) > URING_BATCH || fq_trypop (&n->write_q, &fb)) {
+				break;
+			}
+		}
+
+		if (n_files == 0) {
+			continue;
+		}
+
+		const uint64_t t0 = perf_now ();
+		uring_write_batch (&ring, f, n_files, n->prealloc);
+		const uint64_t t1 = perf_now ();
+		trace_span ("io_uring batch", t0, t1);
+
+		for (i = 0; i < n_files; ) {
+			fb = f[i].fb;
+			const int n_img = frame_images (fb);
+			size_t size[DIRTY_MAX];
+			uint32_t crc[DIRTY_MAX];
+			int k, err = 0;
+			for (k = 0; k < n_img; ++k, ++i) {
+				if (f[i].error) {
+					fprintf (stderr, "Writing to '%s' failed\n", f[i].filename);
+					err = 1;
+				}
+				size[k] = f[i].out->size;
+				crc[k] = f[i].out->crc;
+			}
+			if (err) {
+				n->error = 1;
+			} else {
+				count_frame ();
+				for (k = 0; k < n_img; ++k) {
+					ps->bytes += size[k];
+				}
+				if (n->manifest) {
+					manifest_add (n->manifest, fb->fn, n_img, size, crc, fb->crop);
+				}
+			}
+			perf_count (ps, PERF_WRITE, (t1 - t0) / n_frames);
+			++ps->frames;
+			fq_push (&n->free_q, fb);
+		}
+		ps->busy += t1 - t0;
+	}
+
+	if (ring_ok) {
+		io_uring_queue_exit (&ring);
+	}
+	stage_exit ();
+	return NULL;
+}
 #endif
-		{
-			fprintf (stderr, "Writing to '%s' failed\n", filename);
-			break;
+
+/*** batch mode
+ * variants of a batch are rendered one after another by the same process.
+ * The font, glyph cells and the background pattern do not depend on the
+ * frame-rate and are kept for as long as consecutive variants share them.
+ * The pipeline threads and their text contexts are kept for all variants.
+ */
+typedef struct SharedCache {
+	char font[128];
+	PangoFontDescription *font_desc;
+	GlyphAtlas glyphs;
+	float w, h;
+	uint8_t mode;
+	cairo_surface_t *pattern;
+} SharedCache;
+
+static SharedCache shared;
+
+/* also returns the font description in `desc` */
+static GlyphAtlas const *shared_glyphs (const char *font, PangoFontDescription **desc) {
+	if (!shared.font_desc || strcmp (shared.font, font)) {
+		if (shared.font_desc) {
+			glyph_atlas_free (&shared.glyphs);
+			pango_font_description_free (shared.font_desc);
 		}
-		pthread_mutex_lock (&cnt_mutex);
-		++frame_cnt;
-		pthread_mutex_unlock (&cnt_mutex);
+		snprintf (shared.font, sizeof (shared.font), "%s", font);
+		shared.font_desc = pango_font_description_from_string (font);
+		text_resolve_font (shared.font_desc);
+		glyph_atlas_init (&shared.glyphs, shared.font_desc);
 	}
+	*desc = shared.font_desc;
+	return &shared.glyphs;
+}
 
-	cairo_destroy (cr);
-	cairo_surface_destroy (ct);
+/* test-screen or color bars, without annotations */
+static cairo_surface_t *shared_pattern (const float w, const float h, const uint8_t mode) {
+	if (shared.pattern && shared.w == w && shared.h == h && shared.mode == (mode & 7)) {
+		return shared.pattern;
+	}
+	if (shared.pattern) {
+		cairo_surface_destroy (shared.pattern);
+	}
+	shared.w = w;
+	shared.h = h;
+	shared.mode = mode & 7;
+	shared.pattern = test_pattern (w, h, mode);
+	return shared.pattern;
+}
 
-	pthread_mutex_lock (&thr_mutex);
-	--run_cnt;
-	pthread_mutex_unlock (&thr_mutex);
+static void shared_free (void) {
+	if (shared.font_desc) {
+		glyph_atlas_free (&shared.glyphs);
+		pango_font_description_free (shared.font_desc);
+		shared.font_desc = NULL;
+	}
+	if (shared.pattern) {
+		cairo_surface_destroy (shared.pattern);
+		shared.pattern = NULL;
+	}
+}
 
-	pthread_exit (0);
+/* Pipeline stages run on worker threads that are kept for all variants,
+ * together with their text context (font map and its caches). Every
+ * variant hands one stage to each of as many workers as it needs, more
+ * are started on demand, and waits until all stages returned.
+ */
+typedef struct Worker {
+	pthread_t self;
+	void *(*stage) (void *); ///< NULL: idle
+	void *arg;
+} Worker;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Worker **w;
+	int n;
+	int quit;
+} workers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
+
+static void * worker_run (void *arg) {
+	Worker *w = (Worker*) arg;
+	pthread_mutex_lock (&workers.lock);
+	for (;;) {
+		while (!w->stage && !workers.quit) {
+			pthread_cond_wait (&workers.cond, &workers.lock);
+		}
+		if (!w->stage) {
+			break;
+		}
+		pthread_mutex_unlock (&workers.lock);
+		w->stage (w->arg);
+		pthread_mutex_lock (&workers.lock);
+		w->stage = NULL;
+		pthread_cond_broadcast (&workers.cond);
+	}
+	pthread_mutex_unlock (&workers.lock);
+	if (text_ctx) {
+		g_object_unref (text_ctx);
+		text_ctx = NULL;
+	}
 	return NULL;
 }
 
+/* run `stage` on an idle worker */
+static int worker_start (void *(*stage) (void *), void *arg) {
+	int i;
+	Worker *w = NULL;
+	pthread_mutex_lock (&workers.lock);
+	for (i = 0; i < workers.n && !w; ++i) {
+		if (!workers.w[i]->stage) {
+			w = workers.w[i];
+		}
+	}
+	if (!w) {
+		Worker **ww = realloc (workers.w, (workers.n + 1) * sizeof (Worker*));
+		if (ww) {
+			workers.w = ww;
+			w = calloc (1, sizeof (Worker));
+		}
+		if (!w || pthread_create (&w->self, NULL, worker_run, w)) {
+			pthread_mutex_unlock (&workers.lock);
+			free (w);
+			return -1;
+		}
+		workers.w[workers.n++] = w;
+	}
+	w->stage = stage;
+	w->arg = arg;
+	pthread_cond_broadcast (&workers.cond);
+	pthread_mutex_unlock (&workers.lock);
+	return 0;
+}
+
+/* wait until all stages have returned */
+static void workers_wait (void) {
+	int i;
+	pthread_mutex_lock (&workers.lock);
+	for (i = 0; i < workers.n; ++i) {
+		while (workers.w[i]->stage) {
+			pthread_cond_wait (&workers.cond, &workers.lock);
+		}
+	}
+	pthread_mutex_unlock (&workers.lock);
+}
+
+static void workers_free (void) {
+	int i;
+	pthread_mutex_lock (&workers.lock);
+	workers.quit = 1;
+	pthread_cond_broadcast (&workers.cond);
+	pthread_mutex_unlock (&workers.lock);
+	for (i = 0; i < workers.n; ++i) {
+		pthread_join (workers.w[i]->self, NULL);
+		free (workers.w[i]);
+	}
+	free (workers.w);
+	workers.w = NULL;
+	workers.n = 0;
+}
+
+/* split a job-file line into arguments, in place.
+ * Whitespace separates arguments, single or double quotes group them.
+ */
+static int split_args (char *line, char **args, const int max) {
+	int n = 0;
+	char *r = line;
+	while (*r) {
+		while (*r == ' ' || *r == '\t' || *r == '\n' || *r == '\r') ++r;
+		if (!*r || *r == '#') {
+			break;
+		}
+		if (n == max) {
+			return -1;
+		}
+		char *w = r;
+		args[n++] = w;
+		char quote = 0;
+		for (; *r; ++r) {
+			if (quote) {
+				if (*r == quote) { quote = 0; continue; }
+			} else if (*r == '"' || *r == '\'') {
+				quote = *r;
+				continue;
+			} else if (*r == ' ' || *r == '\t' || *r == '\n' || *r == '\r') {
+				++r;
+				break;
+			}
+			*w++ = *r;
+		}
+		if (quote) {
+			return -1;
+		}
+		*w = '\0';
+	}
+	return n;
+}
+
 /*** main application code and helpers */
 
+static const char *stage_name (const int i, const int n_render, const int n_encode) {
+	if (i < n_render) return "render";
+	if (i < n_render + n_encode) return "encode";
+	return "write";
+}
+
+/* summary of the pipeline performance counters as JSON */
+static int write_stats (FILE *x, StageThread const *thr, const int n_render, const int n_encode, const int n_write,
+		const uint64_t wall, const int w, const int h, const int jobs, const int compression, const char *output)
+{
+	int i;
+	PerfStats sum;
+	uint64_t frames = 0;
+	const double wall_s = wall / 1e9;
+
+	memset (&sum, 0, sizeof (PerfStats));
+	for (i = 0; i < n_render + n_encode + n_write; ++i) {
+		perf_merge (&sum, &thr[i].perf);
+		if (i >= n_render + n_encode) {
+			frames += thr[i].perf.frames;
+		}
+	}
+
+	const double raw = (double)frames * w * h * 3;
+
+	fprintf (x, "{\n");
+	fprintf (x, "  \"version\": \"%s\",\n", VERSION);
+	fprintf (x, "  \"width\": %d,\n", w);
+	fprintf (x, "  \"height\": %d,\n", h);
+	fprintf (x, "  \"output\": \"%s\",\n", output);
+	fprintf (x, "  \"compression\": %d,\n", compression);
+	fprintf (x, "  \"jobs\": %d,\n", jobs);
+	fprintf (x, "  \"threads\": { \"render\": %d, \"encode\": %d, \"write\": %d },\n", n_render, n_encode, n_write);
+	fprintf (x, "  \"frames\": %"PRIu64",\n", frames);
+	fprintf (x, "  \"wall_s\": %.6f,\n", wall_s);
+	fprintf (x, "  \"fps\": %.3f,\n", wall_s > 0 ? frames / wall_s : 0);
+	fprintf (x, "  \"bytes_written\": %"PRIu64",\n", sum.bytes);
+	fprintf (x, "  \"compression_ratio\": %.3f,\n", sum.bytes > 0 ? raw / sum.bytes : 0);
+	fprintf (x, "  \"stages\": {\n");
+	for (i = 0; i < PERF_LAST; ++i) {
+		PerfCounter const *pc = &sum.c[i];
+		fprintf (x, "    \"%s\": { \"count\": %"PRIu64", \"total_s\": %.6f, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f }%s\n",
+				perf_name[i], pc->n, pc->total / 1e9,
+				pc->n > 0 ? pc->total / 1e6 / pc->n : 0,
+				perf_percentile (pc, 50), perf_percentile (pc, 99), pc->max / 1e6,
+				i + 1 < PERF_LAST ? "," : "");
+	}
+	fprintf (x, "  },\n");
+	fprintf (x, "  \"per_thread\": [\n");
+	for (i = 0; i < n_render + n_encode + n_write; ++i) {
+		fprintf (x, "    { \"stage\": \"%s\", \"id\": %d, \"frames\": %"PRIu64", \"busy_s\": %.6f, \"utilization\": %.3f }%s\n",
+				stage_name (i, n_render, n_encode), thr[i].id, thr[i].perf.frames,
+				thr[i].perf.busy / 1e9, wall > 0 ? thr[i].perf.busy / (double)wall : 0,
+				i + 1 < n_render + n_encode + n_write ? "," : "");
+	}
+	fprintf (x, "  ]\n");
+	fprintf (x, "}\n");
+	return ferror (x) ? -1 : 0;
+}
+
+/* Summary of a part of the sequence (--range, --shard) as JSON.
+ * Parts can be joined if all settings match and the ranges are
+ * contiguous. The crc32 of consecutive parts can be combined
+ * (zlib's crc32_combine) to the crc32 of all images in order.
+ * It is only available when built with zlib/png support.
+ */
+static int write_shard (FILE *x, Manifest const *m, const int w, const int h, TimecodeRate const *r,
+		const int mode, const char *font, const int compression, const int64_t fn_start, const int64_t fn_end,
+		const int shard_k, const int shard_n, const char *output)
+{
+	fprintf (x, "{\n");
+	fprintf (x, "  \"version\": \"%s\",\n", VERSION);
+	fprintf (x, "  \"width\": %d,\n", w);
+	fprintf (x, "  \"height\": %d,\n", h);
+	fprintf (x, "  \"fps\": \"%d/%d\",\n", r->fps.num, r->fps.den);
+	fprintf (x, "  \"drop_frame\": %s,\n", r->drop ? "true" : "false");
+	fprintf (x, "  \"mode\": %d,\n", mode);
+	fprintf (x, "  \"font\": \"");
+	json_escape (x, font);
+	fprintf (x, "\",\n");
+	fprintf (x, "  \"compression\": %d,\n", compression);
+	fprintf (x, "  \"output\": \"%s\",\n", output);
+	fprintf (x, "  \"start_frame\": %"PRId64",\n", fn_start);
+	fprintf (x, "  \"frames\": %"PRId64",\n", fn_end - fn_start);
+	fprintf (x, "  \"range\": [%"PRId64", %"PRId64"],\n", m->first, m->end);
+	if (shard_n > 0) {
+		fprintf (x, "  \"shard\": \"%d/%d\",\n", shard_k, shard_n);
+	}
+	fprintf (x, "  \"count\": %"PRId64",\n", m->next - m->first);
+#ifdef CUSTOM_PNG_WRITER
+	/* without zlib no checksums are computed */
+	if (strcmp (output, "y4m")) {
+		fprintf (x, "  \"crc32\": \"%08"PRIx32"\",\n", m->total_crc);
+	}
+#endif
+	fprintf (x, "  \"bytes\": %"PRIu64"\n", m->bytes);
+	fprintf (x, "}\n");
+	return ferror (x) ? -1 : 0;
+}
+
+/* Chrome trace-event format, one track per pipeline thread */
+static int write_trace (FILE *x, StageThread const *thr, const int n_render, const int n_encode, const int n_write, const uint64_t t_start) {
+	int i;
+	size_t e;
+	const char *sep = "";
+
+	fprintf (x, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (i = 0; i < n_render + n_encode + n_write; ++i) {
+		fprintf (x, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+				sep, i + 1, stage_name (i, n_render, n_encode), thr[i].id);
+		sep = ",\n";
+		fprintf (x, "%s{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"sort_index\": %d}}",
+				sep, i + 1, i);
+	}
+	for (i = 0; i < n_render + n_encode + n_write; ++i) {
+		TraceBuf const *tb = &thr[i].trace;
+		for (e = 0; e < tb->n; ++e) {
+			fprintf (x, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+					sep, tb->ev[e].name, i + 1,
+					(tb->ev[e].ts - t_start) / 1e3, tb->ev[e].dur / 1e3);
+		}
+	}
+	fprintf (x, "\n]}\n");
+	return ferror (x) ? -1 : 0;
+}
+
 static int test_dir (char *d) {
 	struct stat s;
 	int result = stat (d, &s);
@@ -963,24 +5076,68 @@ static int test_dir (char *d) {
 
 static void usage (int status) {
 	printf ("tsmm2 - time stamped movie maker.\n\n");
-	printf ("Usage: tsmm2 [ OPTIONS ] <dirname>\n\n");
+	printf ("Usage: tsmm2 [ OPTIONS ] <dirname>\n");
+	printf ("       tsmm2 [ OPTIONS ] --y4m <file>\n");
+	printf ("       tsmm2 [ OPTIONS ] --tar <file>\n");
+	printf ("       tsmm2 [ OPTIONS ] --apng <file>\n");
+	printf ("       tsmm2 [ OPTIONS ] --batch <file>\n\n");
 	printf ("Options:\n\
   -a, --aspect-ratio <num>[/den]\n\
                             set aspect ratio (default 16:9)\n\
                             as SAR = 1, this defines the image width\n\
+  -A, --preallocate         reserve disk space for each PNG file before\n\
+                            writing it (fallocate)\n\
   -b, --no-border           do not render border nor alignment markers\n\
+  -B, --batch <file>        render all variants listed in the file, one\n\
+                            per line, see --variant ('-' for stdin)\n\
   -c, --color-only          do not render stripe patterns\n\
   -C, --compression <c>     PNG/zlib compression level (0-9)\n\
                             0: no compression, 1: fastest, 9: best\n\
   -d, --duration <sec>      set duration in seconds (default: 5)\n\
+  -D, --subdirs <n|hour|minute>\n\
+                            spread PNG images over sub-directories of\n\
+                            <n> frames each, or one per timecode hour\n\
+                            or hour/minute (default: all in <dirname>)\n\
+  -e, --format <fmt>        image file format: png, qoi (lossless, fast),\n\
+                            pam or ppm (uncompressed RGB), raw (frame\n\
+                            buffer as is, described by <prefix>.raw.json)\n\
+                            (default: png)\n\
   -f, --fps <num>[/den]     set frame-rate (default: 25/1)\n\
   -F, --font <name>         font for timecode and info\n\
                             default: DroidSansMono\n\
   -h, --help                display this help and exit\n\
   -H, --height <px>         specify image height (default: 360)\n\
-  -j, --concurrency <n>     number of parallel jobs (default: 2)\n\
+  -I, --io <sync|uring>     file output method for PNG images, 'uring'\n\
+                            batches file operations using io_uring\n\
+                            (default: uring if supported by the system)\n\
+  -j, --concurrency <n>     number of parallel jobs\n\
+                            (default: number of online CPUs)\n\
+  -J, --deflate-threads <n> compress each PNG image using <n> threads\n\
+                            (default: 1). Useful for very large images\n\
+  -m, --motion <list>       comma separated moving patterns, shown in the\n\
+                            center of the test-screen: bar, zoneplate\n\
+                            and sweep (default: none)\n\
+  -M, --manifest            list all PNG images (frame, timecode, path,\n\
+                            size) in <dirname>/<prefix>.manifest\n\
   -n, --name-prefix <txt>   filename prefix (default: 't')\n\
+  -O, --overlay             write the test-screen once, as\n\
+                            <prefix>-background.png, and only the overlay\n\
+                            of each frame, one cropped RGBA PNG per area\n\
+                            (<prefix><frame>-<n>.png) with its position\n\
+                            (oFFs chunk, and --manifest)\n\
+  -K, --resume              keep a checkpoint of completed PNG images and\n\
+                            skip valid images of a previous run with the\n\
+                            same settings\n\
+  -k, --shard <k/N>         render only the k-th of N equal parts\n\
+                            of the sequence, see --range\n\
   -p, --progress            report progress\n\
+  -P, --stats <file>        write per-stage performance counters as JSON\n\
+                            to the given file ('-' for the console)\n\
+  -r, --range <A:B>         render only frames A up to (excluding) B,\n\
+                            numbered as in the complete sequence.\n\
+                            Also writes a .shard summary for joining\n\
+  -R, --trace <file>        record a timeline of all threads in Chrome\n\
+                            trace-event format (chrome://tracing, Perfetto)\n\
   -s, --start-frame <fn>    specify timecode start frame number\n\
                             (default: 0)\n\
   -S, --smpte-hdv           Use SMPTE RP 219:2002 color bars instead\n\
@@ -988,7 +5145,23 @@ static void usage (int status) {
   -T, --title-text <txt>    Specify some text to appear on the first\n\
                             frame. Default: URL to this app.\n\
   -v, --verbose             print info and report progress\n\
+  -W, --variant <options>   render a variant: these options in addition\n\
+                            to the common ones, incl. <dirname>, --y4m\n\
+                            or --tar. May be given more than once\n\
+  -X, --tar <file>          write images as a tar archive to the given\n\
+                            file or named pipe, in order.\n\
+                            Use '-' for stdout.\n\
   -V, --version             print version information and exit\n\
+  -y, --yuv <fmt>           comma separated YUV format for --y4m:\n\
+                            420, 422 or 444 chroma subsampling,\n\
+                            601 or 709 matrix, limited or full range\n\
+                            (default: 420,601,limited)\n\
+  -Y, --y4m <file>          write a YUV4MPEG2 stream to the given file or\n\
+                            named pipe instead of PNG images.\n\
+                            Use '-' for stdout.\n\
+  -Z, --apng <file>         write a single animated PNG, each frame only\n\
+                            covers the area that changed since the\n\
+                            previous one. Use '-' for stdout.\n\
 \n");
 /*-------------------------------------------------------------------------------|" */
 	printf ("\n\
@@ -1025,6 +5198,10 @@ Examples:\n\
  mkdir /tmp/tsmm2;\n\
  tsmm2 -v -f 30/1 -H 720 -d 300 /tmp/tsmm2;\n\
  ffmpeg -r 30/1 -i /tmp/tsmm2/t%%08d.png /tmp/tsmm2.mp4\n\
+\n\
+ tsmm2 -f 30/1 -H 720 -d 300 --y4m - | ffmpeg -i - /tmp/tsmm2.mp4\n\
+\n\
+ tsmm2 -H 720 -d 60 -W \"-f 25 /tmp/tsmm2-25\" -W \"-f 50 /tmp/tsmm2-50\"\n\
 \n");
 	printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
 	        "Website and tracker: <https://github.com/x42/tsmm2>\n");
@@ -1034,30 +5211,90 @@ Examples:\n\
 static struct option const long_options[] =
 {
 	{"aspect-ratio", required_argument, 0, 'a'},
+	{"preallocate",  no_argument, 0, 'A'},
 	{"no-border",    no_argument, 0, 'b'},
 	{"color-only",   no_argument, 0, 'c'},
 	{"compression",  required_argument, 0, 'C'},
 	{"duration",     required_argument, 0, 'd'},
+	{"subdirs",      required_argument, 0, 'D'},
+	{"format",       required_argument, 0, 'e'},
 	{"fps",          required_argument, 0, 'f'},
 	{"font",         required_argument, 0, 'F'},
 	{"help",         no_argument, 0, 'h'},
 	{"height",       required_argument, 0, 'H'},
+	{"io",           required_argument, 0, 'I'},
 	{"concurrency",  required_argument, 0, 'j'},
+	{"deflate-threads", required_argument, 0, 'J'},
+	{"manifest",     no_argument, 0, 'M'},
+	{"motion",       required_argument, 0, 'm'},
 	{"name-prefix",  required_argument, 0, 'n'},
+	{"overlay",      no_argument, 0, 'O'},
+	{"shard",        required_argument, 0, 'k'},
+	{"resume",       no_argument, 0, 'K'},
 	{"progress",     no_argument, 0, 'p'},
+	{"stats",        required_argument, 0, 'P'},
+	{"range",        required_argument, 0, 'r'},
+	{"trace",        required_argument, 0, 'R'},
 	{"start-frame",  required_argument, 0, 's'},
 	{"smpte-hdv",    no_argument, 0, 'S'},
 	{"frame-text",   required_argument, 0, 't'},
 	{"title-text",   required_argument, 0, 'T'},
 	{"verbose",      no_argument, 0, 'v'},
+	{"tar",          required_argument, 0, 'X'},
 	{"version",      no_argument, 0, 'V'},
+	{"yuv",          required_argument, 0, 'y'},
+	{"y4m",          required_argument, 0, 'Y'},
+	{"apng",         required_argument, 0, 'Z'},
+	{"batch",        required_argument, 0, 'B'},
+	{"variant",      required_argument, 0, 'W'},
 	{NULL, 0, NULL, 0}
 };
 
-int main (int argc, char **argv) {
+static const char short_options[] =
+	"a:" /* aspect */
+	"A"  /* preallocate */
+	"b"  /* no-border */
+	"B:" /* batch */
+	"c"  /* color-only */
+	"C:" /* compression */
+	"f:" /* fps */
+	"F:" /* font */
+	"d:" /* duration */
+	"D:" /* subdirs */
+	"e:" /* format */
+	"h"  /* help */
+	"H:" /* height */
+	"I:" /* io */
+	"j:" /* concurrency */
+	"J:" /* deflate-threads */
+	"m:" /* motion */
+	"M"  /* manifest */
+	"n:" /* name-prefix */
+	"O"  /* overlay */
+	"k:" /* shard */
+	"K"  /* resume */
+	"p"  /* progress */
+	"P:" /* stats */
+	"r:" /* range */
+	"R:" /* trace */
+	"s:" /* start-frame */
+	"S"  /* smpte-hdv */
+	"t:" /* frame-text */
+	"T:" /* title-text */
+	"v"  /* verbose */
+	"V"  /* version */
+	"W:" /* variant */
+	"X:" /* tar */
+	"y:" /* yuv */
+	"Y:" /* y4m */
+	"Z:" /* apng */
+	;
+
+/* render one sequence, as specified on the command-line */
+static int tsmm2 (int argc, char **argv) {
 	int i;
 	uint8_t verbose = 0;
-	uint8_t mode = 1; // 0x1: add stripes, 0x2: use HDV/219:2002, 0x04: no border
+	uint8_t mode = 1; // 0x1: add stripes, 0x2: use HDV/219:2002, 0x04: no border, 0x38: MOTION_MASK
 	float w, h;
 	int64_t fn_start, fn_end;
 	double duration; // seconds
@@ -1067,13 +5304,54 @@ int main (int argc, char **argv) {
 	char fontname[120] = FONTFILE;
 	char nameprefix[32] = "t";
 	char font[128];
+	char y4mfile[1024] = "";
+	char tarfile[1024] = "";
+	char apngfile[1024] = "";
+	int fanout = 0;
+	int format = IMG_PNG;
+	int manifest = 0;
+	int overlay = 0;
+	int64_t range_a = -1, range_b = -1;
+	int resume = 0;
+	int shard_k = 0, shard_n = 0;
+	char statsfile[1024] = "";
+	char tracefile[1024] = "";
+	FILE *stream = NULL;
+	FILE *msg = stdout;
+	int status = -1;
+	int64_t *todo = NULL;
+	Manifest mf;
+	Tsmm2Context ctx;
+	Tsmm2Settings ts;
+	Scheduler sched;
+	workNfo nfo;
+	StageThread *thr = NULL;
+	YuvFormat yuvfmt;
 	TimecodeRate rate;
 	Rational aspect;
 #ifdef CUSTOM_PNG_WRITER
 	int compression = Z_BEST_SPEED; // Z_BEST_COMPRESSION
+	int deflate_lanes = 1;
+	int io_uring = -1; // -1: auto, 0: sync, 1: io_uring
+	int prealloc = 0;
+	PngBands bgpng;
+	off_t actl = -1; ///< --apng: position of the acTL chunk
+	uint32_t *done_size = NULL;
+	uint32_t *done_crc = NULL;
+#else
+	const int compression = 6; // libcairo's default
 #endif
 	int jobs;
 
+	/* released at the end, also after errors */
+	memset (&mf, 0, sizeof (Manifest));
+	memset (&ctx, 0, sizeof (Tsmm2Context));
+	memset (&sched, 0, sizeof (Scheduler));
+	memset (&nfo, 0, sizeof (workNfo));
+#ifdef CUSTOM_PNG_WRITER
+	memset (&bgpng, 0, sizeof (PngBands));
+#endif
+
 	/* defaults */
 	destdir[0] = '\0';
 	rate.fps.num = 25;
@@ -1084,29 +5362,14 @@ int main (int argc, char **argv) {
 	h = 360;
 	fn_start = 0;
 	duration = 5.0;
-	jobs = 2;
+	jobs = MAX(1, sysconf (_SC_NPROCESSORS_ONLN));
+	yuvfmt.chroma = 420;
+	yuvfmt.matrix = 601;
+	yuvfmt.full = 0;
 
 	int c;
-	while ((c = getopt_long (argc, argv,
-			   "a:" /* aspect */
-			   "b"  /* no-border */
-			   "c"  /* color-only */
-			   "C:" /* compression */
-			   "f:" /* fps */
-			   "F:" /* font */
-			   "d:" /* duration */
-			   "h"  /* help */
-			   "H:" /* height */
-			   "j:" /* concurrency */
-			   "n:" /* name-prefix */
-			   "p"  /* progress */
-			   "s:" /* start-frame */
-			   "S"  /* smpte-hdv */
-			   "t:" /* frame-text */
-			   "T:" /* title-text */
-			   "v"  /* verbose */
-			   "V", /* version */
-			   long_options, (int *) 0)) != EOF)
+	optind = 0; // re-initialize, variants of a batch are parsed in turn
+	while ((c = getopt_long (argc, argv, short_options, long_options, (int *) 0)) != EOF)
 	{
 		switch (c) {
 			case 'a':
@@ -1121,10 +5384,23 @@ int main (int argc, char **argv) {
 				}
 				break;
 
+			case 'A':
+#ifdef CUSTOM_PNG_WRITER
+				prealloc = 1;
+#else
+				fprintf (stderr, "zlib/png is not supported in this version, -A ignored.\n");
+#endif
+				break;
+
 			case 'b':
 				mode |= 4;
 				break;
 
+			case 'B':
+			case 'W':
+				/* handled in main () */
+				break;
+
 			case 'c':
 				mode &= ~1;
 				break;
@@ -1141,6 +5417,24 @@ int main (int argc, char **argv) {
 				duration = atof (optarg);
 				break;
 
+			case 'D':
+				if (!strcmp (optarg, "hour")) {
+					fanout = FANOUT_HOUR;
+				} else if (!strcmp (optarg, "minute")) {
+					fanout = FANOUT_MINUTE;
+				} else if ((fanout = atoi (optarg)) < 1) {
+					fprintf (stderr, "Error: Invalid sub-directory layout '%s'\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'e':
+				if ((format = image_format_parse (optarg)) < 0) {
+					fprintf (stderr, "Error: Invalid image format '%s'\n", optarg);
+					return -1;
+				}
+				break;
+
 			case 'f':
 				{
 					rate.fps.num = atoi (optarg);
@@ -1159,15 +5453,110 @@ int main (int argc, char **argv) {
 				h = atoi (optarg);
 				break;
 
+			case 'I':
+#ifdef CUSTOM_PNG_WRITER
+				if (!strcmp (optarg, "sync")) {
+					io_uring = 0;
+				} else if (!strcmp (optarg, "uring")) {
+					io_uring = 1;
+				} else {
+					fprintf (stderr, "Error: Invalid I/O method '%s'\n", optarg);
+					return -1;
+				}
+#else
+				fprintf (stderr, "zlib/png is not supported in this version, -I ignored.\n");
+#endif
+				break;
+
 			case 'j':
 				jobs = atoi (optarg);
 				break;
 
+			case 'J':
+#ifdef CUSTOM_PNG_WRITER
+				deflate_lanes = MAX(1, atoi (optarg));
+#else
+				fprintf (stderr, "zlib/png is not supported in this version, -J ignored.\n");
+#endif
+				break;
+
+			case 'k':
+				if (sscanf (optarg, "%d/%d", &shard_k, &shard_n) != 2 || shard_k < 1 || shard_k > shard_n) {
+					fprintf (stderr, "Error: Invalid shard '%s', expected <k>/<N> with 1 <= k <= N\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'K':
+#ifdef CUSTOM_PNG_WRITER
+				resume = 1;
+#else
+				fprintf (stderr, "zlib/png is not supported in this version, --resume is not available.\n");
+				return -1;
+#endif
+				break;
+
+			case 'm':
+				{
+					char list[128];
+					char *tmp, *save = NULL;
+					/* argv is parsed again for every variant of a batch */
+					snprintf (list, sizeof (list), "%s", optarg);
+					for (tmp = strtok_r (list, ",", &save); tmp; tmp = strtok_r (NULL, ",", &save)) {
+						if (!strcmp (tmp, "bar")) {
+							mode |= MOTION_BAR;
+						} else if (!strcmp (tmp, "zoneplate")) {
+							mode |= MOTION_ZONE;
+						} else if (!strcmp (tmp, "sweep")) {
+							mode |= MOTION_SWEEP;
+						} else {
+							fprintf (stderr, "Error: Invalid motion pattern '%s'\n", tmp);
+							return -1;
+						}
+					}
+				}
+				break;
+
+			case 'M':
+				manifest = 1;
+				break;
+
 			case 'n':
 				strncpy (nameprefix, optarg, sizeof(nameprefix));
 				nameprefix[sizeof(nameprefix) -1 ] = '\0';
 				break;
 
+			case 'O':
+#ifdef CUSTOM_PNG_WRITER
+				overlay = 1;
+#else
+				fprintf (stderr, "zlib/png is not supported in this version, --overlay is not available.\n");
+				return -1;
+#endif
+				break;
+
+			case 'P':
+				strncpy (statsfile, optarg, sizeof(statsfile));
+				statsfile[sizeof(statsfile) -1 ] = '\0';
+				break;
+
+			case 'r':
+				{
+					char *tmp = strchr (optarg, ':');
+					range_a = atoll (optarg);
+					range_b = (tmp && tmp[1]) ? atoll (tmp + 1) : -1;
+					if (range_a < 0 || !tmp) {
+						fprintf (stderr, "Error: Invalid frame range '%s', expected <A>:<B>\n", optarg);
+						return -1;
+					}
+				}
+				break;
+
+			case 'R':
+				strncpy (tracefile, optarg, sizeof(tracefile));
+				tracefile[sizeof(tracefile) -1 ] = '\0';
+				break;
+
 			case 'p':
 				verbose |= 2;
 				break;
@@ -1201,20 +5590,95 @@ int main (int argc, char **argv) {
 				printf ("warranty; not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\n");
 				exit (0);
 
+			case 'X':
+				strncpy (tarfile, optarg, sizeof(tarfile));
+				tarfile[sizeof(tarfile) -1 ] = '\0';
+				break;
+
+			case 'y':
+				if (yuv_parse (&yuvfmt, optarg)) {
+					fprintf (stderr, "Error: Invalid YUV format '%s'\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'Y':
+				strncpy (y4mfile, optarg, sizeof(y4mfile));
+				y4mfile[sizeof(y4mfile) -1 ] = '\0';
+				break;
+
+			case 'Z':
+#ifdef CUSTOM_PNG_WRITER
+				strncpy (apngfile, optarg, sizeof(apngfile));
+				apngfile[sizeof(apngfile) -1 ] = '\0';
+#else
+				fprintf (stderr, "zlib/png is not supported in this version, --apng is not available.\n");
+				return -1;
+#endif
+				break;
+
 			case 'h':
 				usage (0);
 
 			default:
-				usage (EXIT_FAILURE);
+				fprintf (stderr, "Try 'tsmm2 --help' for more information.\n");
+				return -1;
+		}
+	}
+
+	if (optind >= argc && strlen (y4mfile) == 0 && strlen (tarfile) == 0 && strlen (apngfile) == 0) {
+		if (argc < 2) {
+			usage (EXIT_FAILURE);
 		}
+		fprintf (stderr, "Error: No destination, expected <dirname>, --y4m, --tar or --apng.\n");
+		return -1;
+	}
+
+	if (optind < argc) {
+		strncpy (destdir, argv[optind], sizeof(destdir));
+		destdir[sizeof(destdir) -1 ] = '\0';
 	}
 
-	if (optind >= argc) {
-		usage (EXIT_FAILURE);
+	if ((strlen (y4mfile) > 0) + (strlen (tarfile) > 0) + (strlen (apngfile) > 0) > 1) {
+		fprintf (stderr, "Error: --y4m, --tar and --apng are mutually exclusive.\n");
+		return -1;
+	}
+	if (overlay && (strlen (y4mfile) > 0 || strlen (apngfile) > 0)) {
+		fprintf (stderr, "Error: --overlay is only available for PNG images.\n");
+		return -1;
+	}
+	if (strlen (apngfile) > 0 && (shard_n > 0 || range_a >= 0)) {
+		fprintf (stderr, "Error: --apng writes a single animation, --range and --shard are not available.\n");
+		return -1;
+	}
+	if (overlay && resume) {
+		fprintf (stderr, "Error: --resume is not available with --overlay.\n");
+		return -1;
+	}
+	if (format != IMG_PNG && (strlen (y4mfile) > 0 || strlen (apngfile) > 0 || overlay)) {
+		fprintf (stderr, "Error: --format is not available with --y4m, --apng or --overlay.\n");
+		return -1;
+	}
+	if (format == IMG_RAW && fanout != 0 && strlen (tarfile) == 0) {
+		/* <prefix>.raw.json describes a flat sequence of files */
+		fprintf (stderr, "Error: --format raw is not available with --subdirs.\n");
+		return -1;
 	}
+#ifndef CUSTOM_PNG_WRITER
+	if (format == IMG_PNG && strlen (tarfile) > 0) {
+		fprintf (stderr, "zlib/png is not supported in this version, --tar is only available with --format qoi, pam, ppm or raw.\n");
+		return -1;
+	}
+#endif
+
+	/* YUV4MPEG2, tar or APNG */
+	const char *streamfile = strlen (tarfile) > 0 ? tarfile : strlen (apngfile) > 0 ? apngfile : y4mfile;
+	const char *streamtype = strlen (tarfile) > 0 ? "tar" : strlen (apngfile) > 0 ? "APNG" : "YUV4MPEG2";
 
-	strncpy (destdir, argv[optind], sizeof(destdir));
-	destdir[sizeof(destdir) -1 ] = '\0';
+	if (!strcmp (streamfile, "-")) {
+		/* keep stdout clean for the video stream */
+		msg = stderr;
+	}
 
 	// sanity checks, part one
 	if (aspect.num < 1 || aspect.den < 1) {
@@ -1229,23 +5693,37 @@ int main (int argc, char **argv) {
 		fprintf (stderr, "Error: Frame-rate %d / %d is less than 1.0 fps\n", rate.fps.num, rate.fps.den);
 		return -1;
 	}
-	if (strlen (destdir) < 1) {
-		fprintf (stderr, "Error: No destination dir is given\n");
-		return -1;
-	}
-	if (test_dir (destdir)) {
-		if (verbose & 1) {
-			printf ("Note: Destination dir does not exists.\n");
-			printf ("Note: Trying to create dir '%s'\n", destdir);
+	if (strlen (streamfile) > 0) {
+		if (strlen (destdir) > 0) {
+			fprintf (stderr, "Note: Writing a %s stream, <dirname> is ignored.\n", streamtype);
+		}
+		if (fanout != 0 || manifest) {
+			fprintf (stderr, "Note: Writing a stream, --subdirs and --manifest are ignored.\n");
+			fanout = manifest = 0;
+		}
+		if (resume) {
+			fprintf (stderr, "Error: --resume is only available for image files.\n");
+			return -1;
+		}
+	} else {
+		if (strlen (destdir) < 1) {
+			fprintf (stderr, "Error: No destination dir is given\n");
+			return -1;
+		}
+		if (test_dir (destdir)) {
+			if (verbose & 1) {
+				printf ("Note: Destination dir does not exists.\n");
+				printf ("Note: Trying to create dir '%s'\n", destdir);
+			}
+			mkdir (destdir, 0755);
+		}
+		if (test_dir (destdir)) {
+			fprintf (stderr, "Error: Destination dir does not exists or lacks write permissions.\n");
+			return -1;
+		}
+		if (strlen (destdir) > 1 && destdir[strlen (destdir) - 1] == DIRSEP) {
+			destdir[strlen (destdir) - 1] = '\0';
 		}
-		mkdir (destdir, 0755);
-	}
-	if (test_dir (destdir)) {
-		fprintf (stderr, "Error: Destination dir does not exists or lacks write permissions.\n");
-		return -1;
-	}
-	if (strlen (destdir) > 1 && destdir[strlen (destdir) - 1] == DIRSEP) {
-		destdir[strlen (destdir) - 1] = '\0';
 	}
 
 	// derive values
@@ -1256,7 +5734,6 @@ int main (int argc, char **argv) {
 	if (rintf (100. * rate.fps.num / (float)rate.fps.den) == 2997) {
 		rate.drop = 1;
 	}
-	jobs = MAX(1, MIN(jobs, fn_end - fn_start));
 
 	// sanity checks, part two
 
@@ -1269,12 +5746,167 @@ int main (int argc, char **argv) {
 		return -1;
 	}
 
+	/* frames to render, relative to fn_start */
+	int64_t r_first = 0;
+	int64_t r_end = fn_end - fn_start;
+	if (shard_n > 0) {
+		r_first = (fn_end - fn_start) * (shard_k - 1) / shard_n;
+		r_end   = (fn_end - fn_start) * shard_k / shard_n;
+	} else if (range_a >= 0) {
+		r_first = range_a;
+		r_end   = range_b >= 0 ? range_b : r_end;
+	}
+	if (r_first < 0 || r_end > fn_end - fn_start || r_first >= r_end) {
+		fprintf (stderr, "Error: Frame range %"PRId64":%"PRId64" is empty or not within 0:%"PRId64".\n",
+				r_first, r_end, fn_end - fn_start);
+		return -1;
+	}
+	const int sharded = shard_n > 0 || range_a >= 0;
+
+	yuv_init (&yuvfmt);
+
+	if (!strcmp (streamfile, "-")) {
+		stream = stdout;
+	} else if (strlen (streamfile) > 0 && !(stream = fopen (streamfile, "wb"))) {
+		fprintf (stderr, "Error: Cannot open '%s' for writing.\n", streamfile);
+		goto out;
+	}
+
+	const int y4m = strlen (y4mfile) > 0;
+	const int apng = strlen (apngfile) > 0;
+	if (y4m && y4m_write_header (stream, w, h, &rate, &yuvfmt)) {
+		fprintf (stderr, "Error: Cannot write YUV4MPEG2 header.\n");
+		goto out;
+	}
+	TarWriter tar;
+	tar_init (&tar, time (NULL));
+
+	if (frame_mkdirs (destdir, fanout, &rate, fn_start, r_first, r_end)) {
+		goto out;
+	}
+
+	/* parts of a sequence may share the destination dir */
+	char partname[1100];
+	if (stream) {
+		snprintf (partname, sizeof (partname), "%s", streamfile);
+	} else if (r_first > 0 || r_end < fn_end - fn_start) {
+		snprintf (partname, sizeof (partname), "%s/%s.%08"PRId64, destdir, nameprefix, r_first);
+	} else {
+		snprintf (partname, sizeof (partname), "%s/%s", destdir, nameprefix);
+	}
+
+	/* frames to render */
+	int64_t n_todo = r_end - r_first;
+#ifdef CUSTOM_PNG_WRITER
+	char ckptname[1200];
+	char settings[1024];
+	if (resume) {
+		int64_t fn;
+		sprintf (ckptname, "%s.checkpoint", partname);
+		/* everything that affects the images */
+		snprintf (settings, sizeof (settings),
+				"# tsmm2 %s %.0fx%.0f fps=%d/%d drop=%d start=%"PRId64" frames=%"PRId64" mode=%d compression=%d subdirs=%d"
+				" font='%s' prefix='%s' title='%s' text='%s'%s%s",
+				VERSION, w, h, rate.fps.num, rate.fps.den, rate.drop, fn_start, fn_end - fn_start, mode, compression, fanout,
+				fontname, nameprefix, title_text, frame_text,
+				format != IMG_PNG ? " format=" : "", format != IMG_PNG ? image_ext[format] : "");
+
+		done_size = calloc (r_end - r_first, sizeof (uint32_t));
+		done_crc  = calloc (r_end - r_first, sizeof (uint32_t));
+		todo      = calloc (r_end - r_first, sizeof (int64_t));
+		if (!done_size || !done_crc || !todo) {
+			fprintf (stderr, "Error: Out of memory.\n");
+			goto out;
+		}
+		const int64_t n_done = resume_scan (ckptname, settings, destdir, fanout, nameprefix,
+				format, image_fixed_size (format, w, h), &rate, fn_start,
+				r_first, r_end, done_size, done_crc);
+		if (n_done < 0) {
+			fprintf (stderr, "Error: The settings differ from the checkpoint '%s'.\n", ckptname);
+			fprintf (stderr, "       Remove it to start over.\n");
+			goto out;
+		}
+		for (fn = r_first, n_todo = 0; fn < r_end; ++fn) {
+			if (done_size[fn - r_first] == 0) {
+				todo[n_todo++] = fn;
+			}
+		}
+		if (verbose & 1) {
+			fprintf (msg, "* Resume:      %"PRId64" of %"PRId64" frames are complete\n", n_done, r_end - r_first);
+		}
+	}
+#endif
+
+	jobs = MAX(1, MIN(jobs, n_todo));
+
+	if (manifest || sharded || resume) {
+		char mfname[1200];
+		sprintf (mfname, "%s.manifest", partname);
+		if (manifest_open (&mf, manifest ? mfname : NULL, r_first, r_end, fn_start, fanout, nameprefix, image_ext[format], &rate, overlay)) {
+			fprintf (stderr, "Error: Cannot create manifest '%s'.\n", mfname);
+			goto out;
+		}
+	}
+#ifdef CUSTOM_PNG_WRITER
+	if (resume) {
+		int64_t fn;
+		if (manifest_checkpoint (&mf, ckptname, settings)) {
+			fprintf (stderr, "Error: Cannot write checkpoint '%s'.\n", ckptname);
+			goto out;
+		}
+		for (fn = r_first; fn < r_end; ++fn) {
+			if (done_size[fn - r_first] > 0) {
+				const size_t sz = done_size[fn - r_first];
+				manifest_add (&mf, fn, 1, &sz, &done_crc[fn - r_first], NULL);
+			}
+		}
+	}
+#endif
+
+#ifdef CUSTOM_PNG_WRITER
+	if (stream) {
+		io_uring = 0;
+	}
+#ifdef HAVE_IO_URING
+	else if (io_uring != 0 && !uring_available ()) {
+		if (io_uring > 0) {
+			fprintf (stderr, "Error: io_uring is not supported by the system.\n");
+			goto out;
+		}
+		io_uring = 0;
+	}
+#else
+	else if (io_uring > 0) {
+		fprintf (stderr, "Error: This version was built without io_uring support.\n");
+		goto out;
+	}
+	io_uring = 0;
+#endif
+#endif
+
+	/* pipeline threads: PNG compression is the bottleneck and gets
+	 * `jobs` threads, drawing the overlay is comparatively cheap.
+	 * Colorspace conversion for streams and the fast image formats
+	 * are on par with drawing.
+	 * A single io_uring thread submits batches of image files.
+	 */
+	const int fast = y4m || format != IMG_PNG;
+	const int n_render = fast ? MAX(1, (jobs + 1) / 2) : MAX(1, (jobs + 3) / 4);
+	const int n_encode = fast ? MAX(1, (jobs + 1) / 2) : jobs;
+#ifdef CUSTOM_PNG_WRITER
+	const int n_write  = (stream || io_uring) ? 1 : MAX(1, (jobs + 7) / 8);
+#else
+	const int n_write  = stream ? 1 : MAX(1, (jobs + 7) / 8);
+#endif
+	/* one buffer per thread + a few to absorb jitter */
+	const int n_buf = n_render + n_encode + n_write + FRAME_POOL_SLACK;
+
 	// all systems go...
 	if (verbose & 1) {
 		char tcs[13], tce[13];
 		TimecodeTime tc;
-		printf ("* Geometry:    %.0f x %.0f px\n", w, h);
-		printf ("* Framerate:   %d / %d (%.3f) %s timecode\n",
+		fprintf (msg, "* Geometry:    %.0f x %.0f px\n", w, h);
+		fprintf (msg, "* Framerate:   %d / %d (%.3f) %s timecode\n",
 				rate.fps.num, rate.fps.den,
 				(rate.fps.num / (double)rate.fps.den),
 				rate.drop ? "drop-frame" : "non-drop-frame");
@@ -1282,65 +5914,253 @@ int main (int argc, char **argv) {
 		format_tc (tcs, &rate, &tc);
 		framenumber_to_timecode (&tc, &rate, fn_end -1);
 		format_tc (tce, &rate, &tc);
-		printf ("* Timecode:    %s -> %s\n", tcs, tce);
-		printf ("* File first:  %s/%s%08d.png\n", destdir, nameprefix, 0);
-		printf ("* File last:   %s/%s%08"PRId64".png\n", destdir, nameprefix, (fn_end - fn_start - 1));
-		printf ("* Concurrency: %d\n", jobs);
+		fprintf (msg, "* Timecode:    %s -> %s\n", tcs, tce);
+		if (sharded) {
+			fprintf (msg, "* Range:       frames %"PRId64" .. %"PRId64" of %"PRId64,
+					r_first, r_end - 1, fn_end - fn_start);
+			if (shard_n > 0) {
+				fprintf (msg, " (shard %d/%d)", shard_k, shard_n);
+			}
+			fprintf (msg, "\n");
+		}
+		if (y4m) {
+			fprintf (msg, "* Stream:      %s (YUV4MPEG2, %d, BT.%d, %s range)\n",
+					stream == stdout ? "<stdout>" : y4mfile,
+					yuvfmt.chroma, yuvfmt.matrix, yuvfmt.full ? "full" : "limited");
+		} else if (apng) {
+			fprintf (msg, "* Stream:      %s (APNG, %"PRId64" frames)\n",
+					stream == stdout ? "<stdout>" : apngfile, r_end - r_first);
+		} else if (stream) {
+			fprintf (msg, "* Stream:      %s (tar, %s%08"PRId64".%s .. %s%08"PRId64".%s)\n",
+					stream == stdout ? "<stdout>" : tarfile,
+					nameprefix, r_first, image_ext[format], nameprefix, r_end - 1, image_ext[format]);
+		} else {
+			char path[1024];
+			frame_path (path, fanout, nameprefix, image_ext[format], &rate, fn_start, r_first, overlay ? 0 : -1);
+			fprintf (msg, "* File first:  %s/%s\n", destdir, path);
+			frame_path (path, fanout, nameprefix, image_ext[format], &rate, fn_start, r_end - 1, overlay ? 0 : -1);
+			fprintf (msg, "* File last:   %s/%s\n", destdir, path);
+		}
+		if (mode & MOTION_MASK) {
+			fprintf (msg, "* Motion:     %s%s%s\n",
+					mode & MOTION_BAR ? " bar" : "",
+					mode & MOTION_ZONE ? " zoneplate" : "",
+					mode & MOTION_SWEEP ? " sweep" : "");
+		}
+		if (overlay) {
+			fprintf (msg, "* Overlay:     cropped RGBA images, background %s-background.png\n", nameprefix);
+		}
+		fprintf (msg, "* Concurrency: %d (threads: %d render, %d encode, %d write)\n", jobs, n_render, n_encode, n_write);
+#ifdef CUSTOM_PNG_WRITER
+		if (!y4m && format == IMG_PNG && deflate_lanes > 1) {
+			fprintf (msg, "* Deflate:     %d threads per frame\n", deflate_lanes);
+		}
+		if (!stream) {
+			fprintf (msg, "* File I/O:    %s%s\n", io_uring ? "io_uring" : "sync", prealloc ? ", preallocate" : "");
+		}
+#endif
 	}
 
 	snprintf (font, 128, "%s %d", fontname, MAX(6, (int)rint (h/22)));
-	font_desc = pango_font_description_from_string (font);
+
+	// create static test-screen and overlay resources, the same as the library's
+	tsmm2_settings_init (&ts);
+	ts.width = w;
+	ts.height = h;
+	ts.fps_num = rate.fps.num;
+	ts.fps_den = rate.fps.den;
+	ts.start_frame = fn_start;
+	ts.frames = fn_end - fn_start;
+	ts.flags = mode;
+	ts.font = fontname;
+	ts.title = title_text;
+	ts.text = frame_text;
+	frame_context_settings (&ctx, &ts);
+	ctx.cache.glyphs = *shared_glyphs (font, &ctx.font);
+	if (frame_context_init (&ctx, shared_pattern (w, h, mode), ts.text)) {
+		fprintf (stderr, "Error: Out of memory\n");
+		goto out;
+	}
 
 	if (verbose & 2) {
-		printf ("progress: %5.1f%%\r", 0.f);
-		fflush (stdout);
+		fprintf (msg, "progress: %5.1f%%\r", 0.f);
+		fflush (msg);
 	}
 
-	// create static test-screen
-	cairo_surface_t * cs = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, w, h);
-	cairo_t* cr = cairo_create (cs);
-	if (mode & 4) {
-		if (mode & 2)
-			smpte02 (cr, w, h);
-		else
-			smpte78 (cr, w, h);
-	} else {
-		testscreen (cr, w, h, mode);
+#ifdef CUSTOM_PNG_WRITER
+	// pre-compress the static background
+	if (!y4m && format == IMG_PNG) {
+		PngEncoder pe;
+		int rv = png_encoder_init (&pe, w, h, compression, 3, deflate_lanes)
+			|| png_bands_init (&bgpng, w, h, compression, 3)
+			|| png_bands_encode (&pe, &bgpng, ctx.bg, NULL, NULL);
+		png_encoder_free (&pe);
+		if (rv) {
+			fprintf (stderr, "Error: Cannot compress background image.\n");
+			goto out;
+		}
+	}
+
+	// the overlay is composited onto a single still of the background
+	if (overlay) {
+		char bgname[1200];
+		PngFile bgfile;
+		FrameFile ff;
+		int rv = png_file_init (&bgfile, &bgpng);
+		if (!rv) {
+			png_file_prepare (&bgfile, &bgpng);
+			frame_file_png (&ff, &bgfile);
+			if (stream) {
+				snprintf (bgname, sizeof (bgname), "%s-background.png", nameprefix);
+				rv = tar_write_file (stream, &tar, bgname, &ff);
+			} else {
+				snprintf (bgname, sizeof (bgname), "%s/%s-background.png", destdir, nameprefix);
+				rv = write_file (&ff, bgname, prealloc);
+			}
+		}
+		png_file_free (&bgfile);
+		if (rv) {
+			fprintf (stderr, "Error: Cannot write background image.\n");
+			goto out;
+		}
+	}
+
+	if (apng && apng_write_header (stream, &bgpng, n_todo, &actl)) {
+		fprintf (stderr, "Error: Cannot write APNG header.\n");
+		goto out;
+	}
+#endif
+
+	// raw frames are described by a sidecar file, the first member of a tar archive
+	if (format == IMG_RAW) {
+		char info[1024];
+		char infoname[1200];
+		int rv = -1;
+		if (stream) {
+			/* prepare the member in memory, its size is part of the tar header */
+			struct iovec iov;
+			FrameFile ff;
+			FILE *x = fmemopen (info, sizeof (info), "w");
+			snprintf (infoname, sizeof (infoname), "%s.raw.json", nameprefix);
+			if (x && !write_raw_info (x, w, h, &rate, fn_start, fn_end, r_first, r_end, nameprefix) && !fflush (x)) {
+				memset (&ff, 0, sizeof (FrameFile));
+				iov.iov_base = info;
+				iov.iov_len = ff.size = ftell (x);
+				ff.iov = &iov;
+				ff.iovcnt = 1;
+				rv = tar_write_file (stream, &tar, infoname, &ff);
+			}
+			if (x) {
+				fclose (x);
+			}
+		} else {
+			snprintf (infoname, sizeof (infoname), "%s.raw.json", partname);
+			FILE *x = fopen (infoname, "w");
+			if (x) {
+				rv = write_raw_info (x, w, h, &rate, fn_start, fn_end, r_first, r_end, nameprefix);
+				if (fclose (x)) {
+					rv = -1;
+				}
+			}
+		}
+		if (rv) {
+			fprintf (stderr, "Error: Cannot write '%s'.\n", infoname);
+			goto out;
+		}
 	}
-	annotate (cr, w, h, &rate, frame_text);
-	cairo_destroy (cr);
 
 	// render timecode
 
-	int64_t spl = (fn_end - fn_start) / jobs;
-	workNfo *nfo = malloc (jobs * sizeof(workNfo));
+	thr = calloc (n_render + n_encode + n_write, sizeof (StageThread));
 
-	int64_t off = 0;;
-	for (i = 0; i < jobs; ++i) {
-		nfo[i].w = w;
-		nfo[i].h = h;
-		nfo[i].rate = &rate;
-		nfo[i].bg = cs;
-		nfo[i].title_text = title_text;
-		nfo[i].destdir = destdir;
-		nfo[i].nameprefix = nameprefix;
-		nfo[i].compression = compression;
-		nfo[i].fn_start = fn_start;
-		nfo[i].fn_end = fn_end;
+	/* streams are written in order: hand out single frames.
+	 * Otherwise use chunks small enough to balance the load at the end.
+	 */
+	if (!thr || sched_init (&sched, n_todo, n_render, stream ? 1 : MIN(16, n_todo / (8 * n_render)))) {
+		fprintf (stderr, "Error: Out of memory.\n");
+		goto out;
+	}
 
-		nfo[i].wk_start = off;
-		off += spl;
-		nfo[i].wk_end = (i == jobs - 1) ? (fn_end - fn_start) : (off);
+	nfo.w = w;
+	nfo.h = h;
+	nfo.sched = &sched;
+	nfo.fn_start = fn_start;
+	nfo.fn_first = r_first;
+	nfo.todo = todo;
+	nfo.rate = &rate;
+	nfo.ctx = &ctx;
+	nfo.destdir = destdir;
+	nfo.nameprefix = nameprefix;
+	nfo.fanout = fanout;
+	nfo.manifest = (manifest || sharded || resume) ? &mf : NULL;
+	nfo.compression = compression;
+	nfo.format = format;
+#ifdef CUSTOM_PNG_WRITER
+	nfo.bgpng = &bgpng;
+	nfo.deflate_lanes = deflate_lanes;
+	nfo.uring = io_uring;
+	nfo.prealloc = prealloc;
+	nfo.checksum = sharded || resume;
+#endif
+	nfo.stream = stream;
+	nfo.y4m = y4m;
+	nfo.tar = (stream && !y4m && !apng) ? &tar : NULL;
+	nfo.yuvfmt = &yuvfmt;
+	nfo.overlay = overlay;
+	nfo.apng = apng;
+	if (apng && bounds_init (&nfo.bounds, 2 * n_buf)) {
+		fprintf (stderr, "Error: Out of memory.\n");
+		goto out;
+	}
+	nfo.n_render = nfo.render_run = n_render;
+	nfo.n_encode = nfo.encode_run = n_encode;
+	nfo.n_write = n_write;
+	nfo.n_buf = n_buf;
+	nfo.trace = strlen (tracefile) > 0;
+
+	nfo.buf = calloc (n_buf, sizeof (FrameBuf));
+	if (!nfo.buf
+			|| fq_init (&nfo.free_q, n_buf + n_render)
+			|| fq_init (&nfo.encode_q, n_buf + n_encode)
+			|| fq_init (&nfo.write_q, n_buf + n_write)) {
+		fprintf (stderr, "Error: Out of memory.\n");
+		goto out;
+	}
+	for (i = 0; i < n_buf; ++i) {
+		if (frame_buf_init (&nfo.buf[i], overlay ? NULL : ctx.bg, w, h, compression, format, y4m ? yuv_frame_size (&yuvfmt, w, h) : 0)) {
+			fprintf (stderr, "Error: Cannot allocate frame buffers.\n");
+			goto out;
+		}
+		fq_push (&nfo.free_q, &nfo.buf[i]);
 	}
 
 	frame_cnt = -1;
 	run_cnt = 0;
 
-	for (i = 0; i < jobs; ++i) {
+	const uint64_t t_start = perf_now ();
+
+	for (i = 0; i < n_render + n_encode + n_write; ++i) {
+		void *(*stage) (void *);
+		if (i < n_render) {
+			stage = render_stage;
+			thr[i].id = i;
+		} else if (i < n_render + n_encode) {
+			stage = encode_stage;
+			thr[i].id = i - n_render;
+		} else {
+			stage = write_stage;
+#if defined CUSTOM_PNG_WRITER && defined HAVE_IO_URING
+			if (nfo.uring) {
+				stage = uring_write_stage;
+			}
+#endif
+			thr[i].id = i - n_render - n_encode;
+		}
+		thr[i].nfo = &nfo;
 		pthread_mutex_lock (&thr_mutex);
 		++run_cnt;
 		pthread_mutex_unlock (&thr_mutex);
-		if (pthread_create (&nfo[i].self, NULL, worker, (void*) &nfo[i])) {
+		if (worker_start (stage, (void*) &thr[i])) {
 			fprintf (stderr, "Fatal error: Cannot start thread.\n");
 			exit (1);
 		}
@@ -1349,32 +6169,138 @@ int main (int argc, char **argv) {
 	while (run_cnt > 0) {
 		usleep (250);
 		if (verbose & 2 && frame_cnt > 0) {
-			const float pr = 100.f * frame_cnt / (fn_end - fn_start - 1);
-			printf ("progress: %5.1f%%\r", pr);
-			fflush (stdout);
+			const float pr = 100.f * frame_cnt / MAX(1, n_todo - 1);
+			fprintf (msg, "progress: %5.1f%%\r", pr);
+			fflush (msg);
+		}
+	}
+
+	workers_wait ();
+
+	const uint64_t t_wall = perf_now () - t_start;
+	char output[16];
+	if (y4m || apng) {
+		strcpy (output, y4m ? "y4m" : "apng");
+	} else if (overlay) {
+		strcpy (output, stream ? "tar-overlay" : "overlay");
+	} else if (stream) {
+		snprintf (output, sizeof (output), "tar%s%s", format != IMG_PNG ? "-" : "", format != IMG_PNG ? image_ext[format] : "");
+	} else {
+		snprintf (output, sizeof (output), "%s", image_ext[format]);
+	}
+
+	if (strlen (statsfile) > 0) {
+		FILE *x = strcmp (statsfile, "-") ? fopen (statsfile, "w") : msg;
+		if (!x || write_stats (x, thr, n_render, n_encode, n_write, t_wall, w, h, jobs, compression, output)) {
+			fprintf (stderr, "Error: Cannot write statistics to '%s'.\n", statsfile);
+		}
+		if (x && x != msg) {
+			fclose (x);
+		}
+	}
+
+	if (strlen (tracefile) > 0) {
+		size_t dropped = 0;
+		FILE *x = fopen (tracefile, "w");
+		int err = !x || write_trace (x, thr, n_render, n_encode, n_write, t_start);
+		if (x && fclose (x)) {
+			err = 1;
+		}
+		if (err) {
+			fprintf (stderr, "Error: Cannot write trace to '%s'.\n", tracefile);
+		}
+		for (i = 0; i < n_render + n_encode + n_write; ++i) {
+			dropped += thr[i].trace.dropped;
+		}
+		if (dropped > 0) {
+			fprintf (stderr, "Note: The trace is incomplete, %zu events did not fit.\n", dropped);
+		}
+	}
+	if (stream) {
+		int err = nfo.error;
+#ifdef CUSTOM_PNG_WRITER
+		if (apng && !err && apng_write_end (stream, actl, n_todo, frame_cnt + 1)) {
+			err = 1;
+		}
+#endif
+		if (!y4m && !apng && !err && tar_write_end (stream)) {
+			err = 1;
+		}
+		if (fflush (stream)) {
+			err = 1;
+		}
+		if (stream != stdout && fclose (stream)) {
+			err = 1;
+		}
+		stream = NULL;
+		if (err) {
+			fprintf (stderr, "Error: Writing %s stream failed.\n", streamtype);
+			goto out;
 		}
 	}
 
-	for (i = 0; i < jobs; ++i) {
-		pthread_join (nfo[i].self, NULL);
+	if (sharded && !nfo.error && !interrupted && strcmp (streamfile, "-")) {
+		char shardname[1200];
+		sprintf (shardname, "%s.shard", partname);
+		FILE *x = fopen (shardname, "w");
+		int err = !x || write_shard (x, &mf, w, h, &rate, mode, font, compression, fn_start, fn_end,
+					shard_k, shard_n, output);
+		if (x && fclose (x)) {
+			err = 1;
+		}
+		if (err) {
+			fprintf (stderr, "Error: Cannot write shard manifest '%s'.\n", shardname);
+			goto out;
+		}
 	}
-	free (nfo);
 
-	cairo_surface_destroy (cs);
-	pango_font_description_free (font_desc);
+	if (manifest_close (&mf)) {
+		fprintf (stderr, "Error: Writing manifest failed.\n");
+		goto out;
+	}
+
+	if (interrupted) {
+		fprintf (stderr, "\nInterrupted after %"PRId64" frames.%s\n", frame_cnt + 1,
+				resume ? " Run again to continue." : "");
+		goto out;
+	}
 
 	if (verbose & 2) {
-		printf ("progress: %5.1f%%\n", 100.f * frame_cnt / (fn_end - fn_start - 1));
+		fprintf (msg, "progress: %5.1f%%\n", 100.f * frame_cnt / MAX(1, n_todo - 1));
 	}
 
-	if (verbose & 1) {
-		char filename[1024] = "";
-		sprintf (filename, "%s/%s%08"PRId64".png", destdir, nameprefix, frame_cnt);
-		printf ("* Wrote %"PRId64" files. Last '%s'\n", frame_cnt, filename);
-		printf (
-				"* Encode movie with e.g.\n"
-				" ffmpeg -r %d/%d -i %s/%s%%08d.png -qscale:v 0 %s.avi\n",
-				rate.fps.num, rate.fps.den, destdir, nameprefix, destdir);
+	if (verbose & 1 && strlen (streamfile) > 0) {
+		fprintf (msg, "* Wrote %"PRId64" frames to '%s'\n", frame_cnt + 1, strcmp (streamfile, "-") ? streamfile : "<stdout>");
+	}
+	else if (verbose & 1) {
+		char path[1024] = "";
+		frame_path (path, fanout, nameprefix, image_ext[format], &rate, fn_start, todo ? r_end - 1 : r_first + frame_cnt, overlay ? 0 : -1);
+		printf ("* Wrote %"PRId64" %s. Last '%s/%s'\n", frame_cnt + 1, overlay ? "frames" : "files", destdir, path);
+		if (overlay) {
+			printf (
+					"* Composite each image onto '%s/%s-background.png'\n"
+					"  at its position, from the image's oFFs chunk%s\n",
+					destdir, nameprefix, manifest ? " or the manifest" : "");
+		} else {
+			char input[64] = "";
+			if (format == IMG_RAW) {
+				snprintf (input, sizeof (input), " -f image2 -c:v rawvideo -pixel_format %s -video_size %.0fx%.0f",
+						raw_pixel_format (), w, h);
+			}
+			if (fanout == 0) {
+				printf (
+						"* Encode movie with e.g.\n"
+						" ffmpeg -r %d/%d%s -i %s/%s%%08d.%s -qscale:v 0 %s.avi\n",
+						rate.fps.num, rate.fps.den, input, destdir, nameprefix, image_ext[format], destdir);
+			} else {
+				/* sub-directory names sort in frame order for up to 99 hours,
+				 * the timecode hour keeps counting after 24h */
+				printf (
+						"* Encode movie with e.g.\n"
+						" ffmpeg -r %d/%d%s -pattern_type glob -i '%s/%s%s*.%s' -qscale:v 0 %s.avi\n",
+						rate.fps.num, rate.fps.den, input, destdir, fanout == FANOUT_MINUTE ? "*/*/" : "*/", nameprefix, image_ext[format], destdir);
+			}
+		}
 	}
 
 #if 0 // suggest audio if duration > 2 sec
@@ -1401,5 +6327,138 @@ int main (int argc, char **argv) {
 			, rate.fps.num, rate.fps.den, destdir, nameprefix, destdir, destdir);
 
 #endif
+	status = 0;
+
+out:
+	if (thr) {
+		for (i = 0; i < nfo.n_render + nfo.n_encode + nfo.n_write; ++i) {
+			free (thr[i].trace.ev);
+		}
+		free (thr);
+	}
+	sched_free (&sched);
+
+	for (i = 0; nfo.buf && i < nfo.n_buf; ++i) {
+		frame_buf_free (&nfo.buf[i]);
+	}
+	free (nfo.buf);
+	fq_free (&nfo.free_q);
+	fq_free (&nfo.encode_q);
+	fq_free (&nfo.write_q);
+	bounds_free (&nfo.bounds);
+
+	frame_context_release (&ctx);
+#ifdef CUSTOM_PNG_WRITER
+	png_bands_free (&bgpng);
+	free (done_size);
+	free (done_crc);
+#endif
+	free (todo);
+	manifest_close (&mf);
+	if (stream && stream != stdout) {
+		fclose (stream);
+	}
+	return status;
+}
+
+#define MAX_VARIANT_ARGS 64
+
+int main (int argc, char **argv) {
+	int i, c;
+	int n_variants = 0;
+	char **variants = NULL;
+	char *batchfile = NULL;
+
+	/* blocking writes continue after a signal, see catch_signal () */
+	struct sigaction sa;
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = catch_signal;
+	sa.sa_flags = SA_RESTART | SA_RESETHAND;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	/* collect variants, all other options are parsed by tsmm2 () */
+	opterr = 0;
+	while ((c = getopt_long (argc, argv, short_options, long_options, (int *) 0)) != EOF) {
+		if (c == 'B') {
+			batchfile = optarg;
+		} else if (c == 'W') {
+			variants = realloc (variants, (n_variants + 1) * sizeof (char*));
+			variants[n_variants++] = strdup (optarg);
+		}
+	}
+	opterr = 1;
+
+	if (batchfile) {
+		char line[4096];
+		FILE *x = strcmp (batchfile, "-") ? fopen (batchfile, "r") : stdin;
+		if (!x) {
+			fprintf (stderr, "Error: Cannot open batch file '%s'.\n", batchfile);
+			return -1;
+		}
+		while (fgets (line, sizeof (line), x)) {
+			line[strcspn (line, "\r\n")] = '\0';
+			char *tmp = line + strspn (line, " \t");
+			if (*tmp == '\0' || *tmp == '#') {
+				continue;
+			}
+			variants = realloc (variants, (n_variants + 1) * sizeof (char*));
+			variants[n_variants++] = strdup (tmp);
+		}
+		if (x != stdin) {
+			fclose (x);
+		}
+		if (n_variants == 0) {
+			fprintf (stderr, "Error: Batch file '%s' does not list any variants.\n", batchfile);
+			return -1;
+		}
+	}
+
+	if (n_variants == 0) {
+		const int rv = tsmm2 (argc, argv);
+		workers_free ();
+		shared_free ();
+		return rv;
+	}
+
+	if (optind < argc) {
+		fprintf (stderr, "Error: In batch mode each variant specifies its own <dirname>, --y4m or --tar.\n");
+		return -1;
+	}
+
+	/* each variant is the common command-line + the variant's options */
+	int failed = 0;
+	char **args = malloc ((argc + MAX_VARIANT_ARGS + 1) * sizeof (char*));
+	for (i = 0; i < n_variants && !interrupted; ++i) {
+		char *v = strdup (variants[i]);
+		memcpy (args, argv, argc * sizeof (char*));
+		const int n = split_args (v, &args[argc], MAX_VARIANT_ARGS);
+		if (n < 0) {
+			fprintf (stderr, "Error: Cannot parse variant %d: %s\n", i + 1, variants[i]);
+			++failed;
+		} else {
+			args[argc + n] = NULL;
+			if (tsmm2 (argc + n, args)) {
+				fprintf (stderr, "Error: Variant %d failed: %s\n", i + 1, variants[i]);
+				++failed;
+			}
+		}
+		free (v);
+	}
+	free (args);
+
+	workers_free ();
+	shared_free ();
+	for (i = 0; i < n_variants; ++i) {
+		free (variants[i]);
+	}
+	free (variants);
+
+	if (failed > 0 || interrupted) {
+		fprintf (stderr, "Error: %d of %d variants failed%s.\n", failed + (n_variants - i), n_variants,
+				interrupted ? " or were interrupted" : "");
+		return -1;
+	}
 	return 0;
 }
+#endif /* TSMM2_LIBRARY */
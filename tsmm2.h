@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2012, 2014 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* libtsmm2: render any frame of a tsmm2 test sequence into a buffer.
+ *
+ *   Tsmm2Settings s;
+ *   tsmm2_settings_init (&s);
+ *   s.height = 720;
+ *   Tsmm2Context *c = tsmm2_context_create (&s);
+ *   tsmm2_render_frame (c, 42, buf, stride);
+ *   tsmm2_context_free (c);
+ *
+ * A context is read-only once created: any number of threads can
+ * render frames of the same context at the same time.
+ */
+#ifndef TSMM2_H
+#define TSMM2_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* test-screen options, the same as the command-line's */
+#define TSMM2_STRIPES      0x01 ///< line patterns, unset: --color-only
+#define TSMM2_SMPTE_HDV    0x02 ///< --smpte-hdv
+#define TSMM2_NO_BORDER    0x04 ///< --no-border
+#define TSMM2_MOTION_BAR   0x08 ///< --motion bar
+#define TSMM2_MOTION_ZONE  0x10 ///< --motion zoneplate
+#define TSMM2_MOTION_SWEEP 0x20 ///< --motion sweep
+
+/* memory layout of a pixel in the caller's buffer, frames are opaque */
+typedef enum Tsmm2PixelFormat {
+	TSMM2_ARGB32 = 0, ///< 32bit 0xAARRGGBB in native byte-order (cairo's ARGB32)
+	TSMM2_RGBA,       ///< 4 bytes: R, G, B, A
+	TSMM2_BGRA,       ///< 4 bytes: B, G, R, A
+	TSMM2_RGB,        ///< 3 bytes: R, G, B
+	TSMM2_BGR,        ///< 3 bytes: B, G, R
+} Tsmm2PixelFormat;
+
+typedef struct Tsmm2Settings {
+	int width;           ///< frame width, 0: 16:9 of the height
+	int height;          ///< frame height (default: 360)
+	int fps_num;         ///< frame-rate numerator (default: 25)
+	int fps_den;         ///< frame-rate denominator (default: 1)
+	int64_t start_frame; ///< timecode of the first frame (default: 0)
+	int64_t frames;      ///< length of the sequence, shown on the first frame (default: 125)
+	int flags;           ///< TSMM2_* options (default: TSMM2_STRIPES)
+	const char *font;    ///< font family, NULL: DroidSansMono
+	const char *title;   ///< text on the first frame, NULL: none
+	const char *text;    ///< text on every frame (--frame-text), NULL: none
+	Tsmm2PixelFormat format; ///< layout of the buffer passed to tsmm2_render_frame()
+} Tsmm2Settings;
+
+typedef struct Tsmm2Context Tsmm2Context;
+
+/* fill in the defaults, the same as the command-line's */
+void tsmm2_settings_init (Tsmm2Settings *s);
+
+/* prepare the static background and overlay resources.
+ * Returns NULL if the settings are invalid or on out of memory.
+ */
+Tsmm2Context *tsmm2_context_create (Tsmm2Settings const *s);
+
+/* render frame `fn` (0 is the first frame of the sequence) into `buffer`
+ * of `height` rows, `stride` bytes each.
+ * Returns 0 on success, -1 for a frame-number outside [0, frames)
+ * or an invalid stride.
+ */
+int tsmm2_render_frame (Tsmm2Context const *c, int64_t fn, uint8_t *buffer, int stride);
+
+/* size of the frames, e.g. if the width was derived from the height */
+void tsmm2_frame_size (Tsmm2Context const *c, int *width, int *height);
+
+void tsmm2_context_free (Tsmm2Context *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif